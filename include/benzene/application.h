@@ -135,6 +135,7 @@ friend class OperationBase;
 friend class DaemonBase;
 friend bool isDaemonManagerThreadCurrent ();
 friend bool wasPauseRequested (unsigned long time);
+friend void reportProgress (float fraction, QString const & phase);
 private:
     Worker & getWorker () const;
 
@@ -166,6 +167,15 @@ private:
 
     unique_ptr<RunDialog> _runDialog;
 
+    // The worker can't push progress to us while it is busy in an operation
+    // (and shouldn't, from an inner loop), so we poll it at frame rate for
+    // as long as an operation is running.
+
+    unique_ptr<QTimer> _progressTimer;
+
+private slots:
+    void onProgressTimer ();
+
 
 friend void ignoreHope (codeplace const &);
 friend class HoistDialog;
@@ -210,6 +220,31 @@ public:
 public:
     methyl::Node<methyl::Accessor const> getDocument() const;
 
+    // If the operation being hovered was run speculatively, this is what
+    // the document would look like after it.  Only meaningful to render
+    // code running on the worker; it is nullopt when there is no preview.
+
+    optional<methyl::Node<methyl::Accessor const>> getPreviewDocument() const;
+
+    // Increases by one every time an operation (or batch of operations)
+    // changes the document.  Safe to ask from any thread; a value that is
+    // remembered and compared later says whether the document has changed
+    // in between.
+
+    quint64 getDocumentGeneration() const;
+
+    // Completed Daemons are kept for reuse until their approximate sizes
+    // add up to more than this, and then the least valuable are freed.
+    // (See DaemonData::approximateSize.)  May be called from any thread.
+
+    void setDaemonMemoryBudget (size_t bytes);
+
+    // Daemons whose DaemonData is persistent save their completed results
+    // here, and later sessions load them rather than computing again.  The
+    // directory is created if need be.  By default there is no cache.
+
+    void setDaemonCacheDirectory (QString const & path);
+
 
     // Originally benzeneEvent was in an interface that could be multiply
     // inherited from.  But the inability to use QObject as a virtual base
@@ -294,8 +329,21 @@ public:
         unique_ptr<OperationBase> && operation
     ) const;
 
+    // Step backward or forward through the operations that declared a
+    // WriteSet.  Like queued operations, these may be asked for from any
+    // thread and happen on the worker when it gets around to them.
+
+    void queueUndo () const;
+
+    void queueRedo () const;
+
+signals:
+    void undoRequested () const;
+
+    void redoRequested () const;
+
 private slots:
-    void onBeginInvokeOperation (QString const & message);
+    void onBeginInvokeOperation (QString const & message, bool cancellable);
 
     void onEndInvokeOperation (bool success, QString const & message);
 
@@ -379,6 +427,16 @@ public:
         return *methyl::Node<T>::checked(app->getDocument());
     }
 
+    static optional<methyl::Node<T const>> getPreviewDocument () {
+        auto app = dynamic_cast<ApplicationBase *>(
+            QApplication::instance()
+        );
+        auto preview = app->getPreviewDocument();
+        if (not preview)
+            return nullopt;
+        return *methyl::Node<T>::checked(*preview);
+    }
+
 public:
     ~Application () override {
     }
@@ -394,6 +452,17 @@ public:
 bool wasPauseRequested (unsigned long time = 0);
 
 
+// Also callable from either an Operation's invoke() or a Daemon, this tells
+// the framework how far along the work is (from 0.0 to 1.0), and optionally
+// what phase it is in.  It's fine to call it on every pass of an inner
+// loop; the fraction is just stored atomically and the GUI picks it up at
+// its own pace.  (Passing a phase costs a lock, so only pass it when the
+// phase actually changes.)  For operations it drives the RunDialog and
+// OperationStatusBar; for Daemons see tryGetDaemonProgress().
+
+void reportProgress (float fraction, QString const & phase = QString ());
+
+
 // nasty spinlock, for testing only!
 inline void timedSpinlock(int milliseconds) {
     QTime timer;
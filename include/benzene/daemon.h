@@ -24,6 +24,12 @@
 #define BENZENE_DAEMON_H
 
 #include <unordered_set>
+#include <atomic>
+
+#include <QMutex>
+#include <QReadWriteLock>
+#include <QElapsedTimer>
+#include <QDataStream>
 
 #include "methyl/accessor.h"
 #include "methyl/observer.h"
@@ -45,6 +51,12 @@ template <class> class Daemon;
 
 class DaemonManager;
 
+class InternedDescriptor;
+
+class DaemonSnapshots;
+
+template <class> struct MaybeStaleSnapshot;
+
 
 // The Benzene framework is the one doing the creation of Daemons on your
 // behalf, via snapshot<DaemonType>(descriptor).  Yet it needs to create the
@@ -54,10 +66,102 @@ class DaemonManager;
 // type templated code to do the allocation to the ThinkerManager thread to
 // do the allocation of the derived type from generic code which only knows
 // about the DaemonBase.
+//
+// It also carries the Daemon class's idea of which part of the document it
+// reads, so the observer can be set up on that before construction...and
+// its way of writing out a descriptor, for naming and checking the files
+// in the on-disk cache.
+
+struct DaemonFactory {
+    std::function<
+        unique_ptr<ThinkerBase>(methyl::Node<Descriptor const>)
+    > create;
+
+    optional<methyl::Node<methyl::Accessor const>> (*observationRootFor)(
+        methyl::Node<Descriptor const>
+    );
+
+    bool (*serializeDescriptor)(
+        QDataStream &,
+        methyl::Node<Descriptor const>
+    );
+};
+
+
+// Who is waiting on a Daemon decides how soon it should get to run.  By
+// default that is inferred from the requesting thread: the worker and
+// GUI are Interactive (someone is looking at a screen that isn't drawn
+// yet), a Daemon passes on its own priority to the Daemons it asks for,
+// and prefetches are Speculative.  While any Interactive Daemon is
+// unfinished, Speculative ones that are running are paused to make room,
+// though one that has waited long enough is let to run for a while.
+
+enum class DaemonPriority {
+    Speculative,
+    Background,
+    Interactive
+};
+
+
+// A DaemonRequest bundles up everything the framework needs to find or
+// create a Daemon, without knowing its type at compile time.  This lets
+// code that isn't itself templated (such as an Operation, which may want
+// to declare a heterogeneous list of Daemons it will be needing) hand
+// over requests to be serviced later.  Build them with makeDaemonRequest.
+// Setting the priority overrides the one that would have been inferred.
 
-typedef std::function<
-    unique_ptr<ThinkerBase>(methyl::Node<Descriptor const>)
-> DaemonFactory;
+struct DaemonRequest {
+    methyl::Tree<Descriptor> descriptor;
+
+    DaemonFactory factory;
+
+    std::type_info const * info;
+
+    optional<DaemonPriority> priority;
+};
+
+
+// Identifies a Daemon without holding onto its descriptor.  Two Daemons of
+// different descriptors may share a key if the hashes collide, so it is
+// only used where a false match is harmless (e.g. keeping a Daemon alive
+// for a little longer than necessary).
+
+struct DaemonKey {
+    std::type_info const * info;
+
+    size_t descriptorHash;
+
+    bool operator== (DaemonKey const & other) const {
+        return (*info == *other.info)
+            and (descriptorHash == other.descriptorHash);
+    }
+};
+
+} // end namespace benzene
+
+
+namespace std {
+
+template<>
+struct hash<benzene::DaemonKey> {
+    size_t operator() (benzene::DaemonKey const & key) const {
+        return key.info->hash_code() ^ key.descriptorHash;
+    }
+};
+
+} // end namespace std
+
+
+namespace benzene {
+
+// What a Daemon has said about how far along it is, via reportProgress().
+// The fraction is nullopt if it hasn't reported anything yet.
+
+struct DaemonProgress {
+    optional<float> fraction;
+
+    QString phase;
+};
 
 
 
@@ -110,6 +214,31 @@ private:
 
     shared_ptr<methyl::Observer> _observer;
 
+    // The roots of the document subtrees the observer is watching.  Used to
+    // decide whether an operation's WriteSet could possibly have any effect
+    // on this Daemon, without needing to ask the observer.
+
+    std::vector<methyl::Node<methyl::Accessor const>> _observedRoots;
+
+    // The document generation this Daemon was created in.  Surviving an
+    // operation without the observer being blinded carries it forward,
+    // which the DaemonManager tracks for all Daemons at once; see
+    // getGeneration().  Checking a Daemon against the current document is
+    // then a number comparison.
+    //
+    // Once it's discarded it is no longer carried forward, though whoever
+    // still holds it (a snapshot, or stale results) may keep asking.  So
+    // the last generation it was valid for is stamped on it then.
+
+    std::atomic<quint64> _generation;
+
+    std::atomic<bool> _isDiscarded;
+
+    // Interned form of the descriptor, which is the Daemon's key in the
+    // map...so it can be found there without a search.
+
+    shared_ptr<InternedDescriptor const> _interned;
+
 
 private:
     // The DaemonManagerThread has a periodic timer task to go through and
@@ -119,17 +248,141 @@ private:
     // how large the DaemonData size are.  Also, if a high-priority
     // Daemon is unfinished and has registered a dependency on the data,
     // we don't want to free it.
+    //
+    // Only completed Daemons are collected; the size is what was measured
+    // when it completed, and the time is summed over all its runs.
+    //
+    // Every snapshot would otherwise write the request tick, bouncing its
+    // cache line between all the threads reading a popular Daemon.  So it
+    // is only written when it has moved on by more than the slack, which
+    // is plenty accurate for the collector's purposes.
+
+    std::atomic<qint64> _lastRequestTick;
+
+    static qint64 const msecRequestTickSlack = 250;
 
-    qint64 _lastRequestTick;
+    std::atomic<qint64> _msecsUsed;
 
-    qint64 _msecsUsed;
+    std::atomic<size_t> _approximateSize;
 
-    std::unordered_set<methyl::Node<Descriptor const>> _dependents;
+    std::atomic<bool> _isComplete;
+
+    DaemonKey _key;
+
+    // Dependents are added from whichever Daemon thread took a snapshot,
+    // and pruned by the collector, so they need their own lock.
+
+    QMutex _dependentsMutex;
+
+    std::unordered_set<DaemonKey> _dependents;
+
+
+private:
+    // If the DaemonData is persistent and a cache directory was set, this
+    // is the file its results belong in, after the header saying what they
+    // are the results of.  When that file already existed with the same
+    // header, the rest of it is the seed, which is loaded instead of
+    // computing.
+    // A seeded Daemon made no observations, so its observer can't tell us
+    // when it's invalid; it is thrown out by any write that pauses it.
+
+    QString _cachePath;
+
+    QByteArray _cacheHeader;
+
+    QByteArray _cacheSeed;
+
+    std::atomic<bool> _isSeeded;
+
+    static void writeCacheFile (QString const & path, QByteArray const & bytes);
+
+    virtual bool isPersistent () const = 0;
+
+    virtual quint32 getCacheVersion () const = 0;
+
+
+private:
+    // When the data class is incremental, a Daemon may be handed the last
+    // results of the one it replaces (which was thrown out by an edit).
+    // The present keeps those results alive; it's let go of by the manager
+    // when this Daemon completes, as the last reference to a present has to
+    // be dropped on the thread that started it.  The changed roots are the
+    // edited parts of the document under what the old Daemon observed, and
+    // every change since it completed is somewhere beneath one of them.
+
+    optional<ThinkerPresentBase> _previous;
+
+    std::vector<methyl::Node<methyl::Accessor const>> _changedRoots;
+
+    virtual bool isIncremental () const = 0;
+
+    virtual bool isServedStale () const = 0;
 
 
 template<class> friend class Daemon;
 private:
-    bool _needsRequeue;
+    // A Daemon that returns Status::Dependent is parked, not thrown away.
+    // While it runs, every Daemon it asks for that isn't complete (or isn't
+    // there at all) is noted in _awaiting; only its own thread touches that.
+    // On parking, those keys are handed to the DaemonManager, which pauses
+    // it and resumes it once they have all completed.  The serial number is
+    // how the manager finds it again without trusting a pointer that may
+    // have been freed meanwhile.
+
+    quint64 _serial;
+
+    std::unordered_set<DaemonKey> _awaiting;
+
+    std::atomic<bool> _isParked;
+
+    void beginRun ();
+
+    bool park ();
+
+    // Thinker-Qt only lets a Thinker return unfinished once it has been
+    // asked to pause, so after telling the manager it is parking, a Daemon
+    // blocks until that request comes.  The wait is on Thinker-Qt's own
+    // condition, which the request signals; there's no polling.  Handling
+    // the park message always ends in a pause request (or one was made by
+    // a pause window or a cancellation already), so the pool thread is
+    // held only until the manager gets to the message.
+
+    void waitToBePaused ();
+
+
+private:
+    // How many of the Daemons named by getPrerequisites() are yet to be
+    // complete.  The manager counts them down as they finish, and the
+    // Daemon won't get its startDaemon() call before it's zero.  Until
+    // then it is parked, and the manager resumes it when the count is.
+
+    std::atomic<int> _prerequisitesPending;
+
+    std::vector<DaemonKey> _prerequisiteKeys;
+
+
+private:
+    // A DaemonPriority, as an int so it can be atomically raised from
+    // whichever thread asks for the Daemon.  It only ever goes up.
+
+    std::atomic<int> _priority;
+
+    bool awaitPrerequisites ();
+
+    void announceCompletion ();
+
+
+friend void reportProgress (float fraction, QString const & phase);
+private:
+    // Written by the Daemon's own thread through reportProgress(), read by
+    // whoever asks with tryGetDaemonProgress().  Ten-thousandths, with -1
+    // for "hasn't said".
+
+    std::atomic<int> _progressPermyriad;
+
+    QMutex _progressPhaseMutex;
+
+    QString _progressPhase;
 
 
 friend class DaemonCreateThread;
@@ -145,18 +398,141 @@ private:
         Args &&... args
     );
 
+    friend void prefetchDaemons (std::vector<DaemonRequest> && requests);
+
+    friend DaemonSnapshots trySnapshotDaemons (
+        std::vector<DaemonRequest> && requests
+    );
+
+    template <class DaemonType, class... Args> friend
+    optional<DaemonProgress> tryGetDaemonProgress (Args &&... args);
+
+    static optional<DaemonProgress> getProgressPrivate (
+        ThinkerPresentBase & present
+    );
+
+    template <class DaemonType, class... Args> friend
+    optional<typename DaemonType::Snapshot> snapshotDaemonWithin (
+        unsigned long msecs,
+        Args &&... args
+    );
+
+    static bool isCompletePrivate (ThinkerPresentBase & present);
+
+    static quint64 getGenerationPrivate (ThinkerPresentBase & present);
+
+    template <class DaemonType, class... Args> friend
+    optional<MaybeStaleSnapshot<DaemonType>> trySnapshotDaemonMaybeStale (
+        Args &&... args
+    );
+
+    static optional<ThinkerPresentBase> tryGetStaleDaemonPresentPrivate (
+        methyl::Tree<Descriptor> const & descriptor,
+        std::type_info const & info,
+        quint64 & generation
+    );
+
+    static optional<ThinkerPresentBase> tryGetStaleInternedPresentPrivate (
+        shared_ptr<InternedDescriptor const> const & descriptor,
+        std::type_info const & info,
+        quint64 & generation
+    );
+
+    template <class DaemonType, class... Args>
+    static optional<ThinkerPresentBase> tryGetStaleDaemonPresentFor (
+        quint64 & generation,
+        Args &&... args
+    );
+
+    template <class DaemonType, class... Args>
+    static optional<ThinkerPresentBase> tryGetStaleDaemonPresentFor (
+        std::false_type hasKey,
+        quint64 & generation,
+        Args &&... args
+    );
+
+    template <class DaemonType, class... Args>
+    static optional<ThinkerPresentBase> tryGetStaleDaemonPresentFor (
+        std::true_type hasKey,
+        quint64 & generation,
+        Args &&... args
+    );
+
+    // Something to wait on for Daemons to be created or finish.  Read the
+    // epoch before looking, and the wait returns straight away if anything
+    // happened since then.
+
+    static quint64 getSettleEpochPrivate ();
+
+    static void waitForSettlePrivate (quint64 epoch, unsigned long msecs);
+
+    template <class DaemonType, class... Args> friend
+    optional<typename DaemonType::Snapshot> trySnapshotDaemonAtPriority (
+        DaemonPriority priority,
+        Args &&... args
+    );
+
     static optional<ThinkerPresentBase> tryGetDaemonPresentPrivate (
         methyl::Tree<Descriptor> && descriptor,
         DaemonFactory factory,
-        std::type_info const & info
+        std::type_info const & info,
+        optional<DaemonPriority> priority,
+        shared_ptr<InternedDescriptor const> * internedOut = nullptr
+    );
+
+    static optional<ThinkerPresentBase> tryGetInternedDaemonPresentPrivate (
+        shared_ptr<InternedDescriptor const> const & descriptor,
+        std::type_info const & info,
+        optional<DaemonPriority> priority
+    );
+
+    // What all the snapshotting functions have in common.  If the Daemon
+    // class has a typed Key then it is tried first, and the descriptor is
+    // only packed if that doesn't turn up an existing Daemon.
+
+    template <class DaemonType, class... Args>
+    static optional<ThinkerPresentBase> tryGetDaemonPresentFor (
+        optional<DaemonPriority> priority,
+        Args &&... args
     );
 
+    template <class DaemonType, class... Args>
+    static optional<ThinkerPresentBase> tryGetDaemonPresentFor (
+        std::false_type hasKey,
+        optional<DaemonPriority> priority,
+        Args &&... args
+    );
+
+    template <class DaemonType, class... Args>
+    static optional<ThinkerPresentBase> tryGetDaemonPresentFor (
+        std::true_type hasKey,
+        optional<DaemonPriority> priority,
+        Args &&... args
+    );
+
+
+protected:
+    // Lets a Daemon know which generation of the document it is working
+    // from, e.g. to stamp results it hands off to somewhere else.  It is
+    // only a number; an older generation can't be read once it is gone.
+    quint64 getGeneration () const;
 
 protected:
     virtual Status startDaemon () = 0;
 
     virtual Status resumeDaemon () = 0;
 
+    // If a Daemon knows from its descriptor alone which other Daemons it
+    // will need, it can say so here.  They are all created at once (and
+    // so can run in parallel), and startDaemon() is held back until every
+    // one is complete.  Called on the DaemonManager thread right after
+    // construction.  Anything left out can still be discovered the usual
+    // way, by getting a nullopt snapshot and returning Dependent.
+
+    virtual std::vector<DaemonRequest> getPrerequisites () const {
+        return std::vector<DaemonRequest> ();
+    }
+
 
 protected:
     void afterThreadAttach (ThinkerBase & thinker);
@@ -177,10 +553,57 @@ public:
 // 
 //     https://github.com/hostilefork/benzene/issues/6
 //
-// No good use cases yet, but futureproofing in case one comes up.
+// The first use is telling the garbage collector how much memory the data
+// holds on to.  sizeof() of the data class is already counted, so this is
+// for what it owns on the heap (containers, strings, images...).  A rough
+// figure is fine; the default says there is nothing beyond sizeof().
+//
+// The second is the on-disk cache.  A data class opts in by hiding the
+// static isPersistent with its own that is true, and implementing the
+// serialization pair.  (Its Daemon class must also be able to write out
+// its descriptors; see serializeDescriptor.)  Results are only ever read
+// back by the same type for the same descriptor and the same content in
+// its observed subtrees.  Files written by an older version of the format
+// are ignored, so cacheVersion should be hidden with a higher number each
+// time serialize() changes what it writes.  If deserialize returns false,
+// the data must be as it was constructed; the Daemon will then be started
+// normally.
+//
+// The third is incremental updating.  A data class that hides the static
+// isIncremental with a true one says its Daemon can bring old results up
+// to date more cheaply than starting over.  When an edit throws out such a
+// Daemon after it completed, its results are set aside; if it's asked for
+// again, the new one gets updateDaemon() instead of startDaemon().
+//
+// The fourth is serving stale results.  If the static isServedStale is
+// hidden with a true one, the results of a completed Daemon thrown out by
+// an edit are still given by trySnapshotDaemonMaybeStale() (flagged as
+// stale) until the Daemon replacing it completes.
 //
 
 class DaemonData : public SnapshottableData {
+public:
+    virtual size_t approximateSize () const {
+        return 0;
+    }
+
+public:
+    static bool const isPersistent = false;
+
+    static quint32 const cacheVersion = 0;
+
+    static bool const isIncremental = false;
+
+    static bool const isServedStale = false;
+
+    virtual void serialize (QDataStream & out) const {
+        Q_UNUSED(out);
+    }
+
+    virtual bool deserialize (QDataStream & in) {
+        Q_UNUSED(in);
+        return false;
+    }
 };
 
 
@@ -223,9 +646,12 @@ class DaemonData : public SnapshottableData {
 // Some Daemons build their calculations on work done by other Daemons.
 // However, these derived Daemons may only run if the other Daemon is
 // finished.  If they ask for a snapshot and receive nothing back, then
-// that means they need to yield to the scheduler.  They may request
-// several different depedencies but will only be called again when
-// those dependencies have been satisfied.
+// that means they need to yield to the scheduler by returning Dependent.
+// They may request several different depedencies but will only be called
+// again (through resumeDaemon, with their state intact) when those
+// dependencies have been satisfied.  Spurious resumes are possible, such
+// as at the end of a pause window, so a Daemon should be prepared to find
+// it is still missing something and return Dependent again.
 //
 
 template <class T>
@@ -251,43 +677,166 @@ public:
     }
 
 
+public:
+    // Packing a descriptor means building a Methyl tree, which is a lot of
+    // allocation for a request that usually turns out to be for a Daemon
+    // that already exists.  A Daemon class can hide this with a hashable
+    // (std::hash) and comparable struct, along with a static makeKey()
+    // taking the same arguments as packDescriptor().  Equal keys must mean
+    // equal descriptors.
+
+    typedef void Key;
+
+    // By default a Daemon is considered to depend on the whole document, so
+    // any edit that its observer notices will invalidate it.  A Daemon that
+    // only looks at one section (say) can hide this, and return the root
+    // of that section given its descriptor.  It's then unaffected by edits
+    // elsewhere.  If the root ends up detached from the document the Daemon
+    // is discarded...but if it's only moved, the Daemon is kept.  So one
+    // that cares where its subtree sits should watch from higher up.
+    //
+    // The observer is set up on whatever this returns, so it's called with
+    // no observer in effect.  It can follow what the descriptor refers to,
+    // but must not read the document to find the root (such as searching
+    // for a section by its title); nothing would notice that changing.
+
+    static optional<methyl::Node<methyl::Accessor const>> observationRootFor (
+        methyl::Node<Descriptor const> descriptor
+    ) {
+        Q_UNUSED(descriptor);
+        return nullopt;
+    }
+
+    // Files in the on-disk cache are named by (and hold a copy of) the
+    // descriptor they were computed for, so it has to be written in a form
+    // that is the same from one run to the next.  A persistent Daemon hides
+    // this with one writing whatever unpackDescriptor() would read, and
+    // returning true.  Until it does, its results are never cached.
+
+    static bool serializeDescriptor (
+        QDataStream & out,
+        methyl::Node<Descriptor const> descriptor
+    ) {
+        Q_UNUSED(out);
+        Q_UNUSED(descriptor);
+        return false;
+    }
+
+
 private:
     bool _firstRun;
 
-    bool start() override final {
-        Status status = _firstRun ? startDaemon() : resumeDaemon();
-        _firstRun = false;
-        switch (status) {
-        case Status::Complete:
-            return true;
-        case Status::Pause:
-            return false;
-        case Status::Dependent:
-            hopefully(not _needsRequeue, HERE);
-            _needsRequeue = true;
-            return true;
+    bool isPersistent () const override {
+        return T::isPersistent;
+    }
+
+    quint32 getCacheVersion () const override {
+        return T::cacheVersion;
+    }
+
+    bool isIncremental () const override {
+        return T::isIncremental;
+    }
+
+    bool isServedStale () const override {
+        return T::isServedStale;
+    }
+
+    void recordCompletion () {
+        _progressPermyriad = 10000;
+        _approximateSize = sizeof(T) + this->readable().approximateSize();
+        _isComplete = true;
+
+        if (not _cachePath.isEmpty() and not _isSeeded) {
+            QByteArray bytes = _cacheHeader;
+            QDataStream stream (&bytes, QIODevice::Append);
+            this->readable().serialize(stream);
+            writeCacheFile(_cachePath, bytes);
         }
 
-        throw hopefullyNotReached(HERE);
+        announceCompletion();
+    }
+
+    // A Daemon parked before its first run is resumed, not started, so the
+    // two have the same body; _firstRun says which of the client's calls
+    // it should get.
+
+    bool start() override final {
+        return runDaemon();
     }
 
     bool resume() override final {
-        Status status = resumeDaemon();
+        return runDaemon();
+    }
+
+    bool runDaemon () {
+        if (_firstRun and not _cacheSeed.isEmpty()) {
+            QDataStream stream (_cacheSeed);
+            bool seeded = this->writable().deserialize(stream);
+            _cacheSeed.clear();
+
+            if (seeded) {
+                _firstRun = false;
+                _isSeeded = true;
+                recordCompletion();
+                return true;
+            }
+        }
+
+        beginRun();
+
+        if (_firstRun and awaitPrerequisites())
+            return false;
+
+        QElapsedTimer timer;
+        timer.start();
+
+        Status status;
+        if (not _firstRun)
+            status = resumeDaemon();
+        else if (_previous) {
+            auto previous = typename Thinker<T>::Present (
+                *_previous
+            ).createSnapshot();
+            status = updateDaemon(previous, _changedRoots);
+        }
+        else
+            status = startDaemon();
+        _firstRun = false;
+
+        _msecsUsed += timer.elapsed();
+
         switch (status) {
         case Status::Complete:
+            recordCompletion();
             return true;
         case Status::Pause:
             return false;
         case Status::Dependent:
-            hopefully(not _needsRequeue, HERE);
-            _needsRequeue = true;
-            return true;
+            return park();
         }
 
         throw hopefullyNotReached(HERE);
     }
 
 
+protected:
+    // Called instead of startDaemon() when there are results to update;
+    // see DaemonData.  The writable data starts out as constructed, not
+    // as a copy of the previous results, so anything that's still good
+    // has to be brought across.  The changed roots may have been moved or
+    // detached since, and nodes beneath them may be gone.  The default
+    // just starts over.
+
+    virtual Status updateDaemon (
+        typename Thinker<T>::Snapshot const & previous,
+        std::vector<methyl::Node<methyl::Accessor const>> const & changed
+    ) {
+        Q_UNUSED(previous);
+        Q_UNUSED(changed);
+        return startDaemon();
+    }
+
 protected:
     void afterThreadAttach () override {
         DaemonBase::afterThreadAttach(*this);
@@ -303,6 +852,249 @@ public:
 
 
 
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::makeDaemonRequest()
+//
+// Packs the descriptor for a Daemon of type T and wraps up its construction
+// into a DaemonFactory.  (The factory has to be made here, where the type is
+// known, because the allocation is done later on the DaemonManager thread
+// by code that only knows about DaemonBase.)
+//
+
+template <class T, class... Args>
+DaemonRequest makeDaemonRequest (
+    Args &&... args
+) {
+    static_assert(
+        std::is_base_of<DaemonBase, T>::value,
+        "makeDaemonRequest<>() must be parameterized with a Daemon class"
+    );
+
+    DaemonFactory factory {
+        [] (methyl::Node<Descriptor const> descriptor) {
+            return unique_ptr<ThinkerBase> (
+                new T (T::unpackDescriptor(descriptor))
+            );
+        },
+        &T::observationRootFor,
+        &T::serializeDescriptor
+    };
+
+    return DaemonRequest {
+        T::packDescriptor(std::forward<Args>(args)...),
+        factory,
+        &typeid(T),
+        nullopt
+    };
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::DaemonKeyIndex<Key>
+//
+// Remembers which interned descriptor a typed key turned out to be, for
+// one Daemon class.  Only weak references are kept, and an entry is just
+// a hint: the Daemon may since have been freed, in which case the lookup
+// in the DaemonManager misses and the descriptor gets packed after all.
+//
+
+template <class Key>
+class DaemonKeyIndex {
+public:
+    DaemonKeyIndex () :
+        _pruneAt (minimumPruneSize)
+    {
+    }
+
+    shared_ptr<InternedDescriptor const> tryFind (Key const & key) const {
+        QReadLocker lock (&_lock);
+
+        auto it = _entries.find(key);
+        if (it == _entries.end())
+            return nullptr;
+        return it->second.lock();
+    }
+
+    void remember (
+        Key const & key,
+        shared_ptr<InternedDescriptor const> const & descriptor
+    ) {
+        QWriteLocker lock (&_lock);
+
+        _entries[key] = descriptor;
+
+        if (_entries.size() < _pruneAt)
+            return;
+
+        auto it = _entries.begin();
+        while (it != _entries.end()) {
+            if (it->second.expired())
+                it = _entries.erase(it);
+            else
+                it++;
+        }
+
+        _pruneAt = _entries.size() * 2;
+        if (_pruneAt < minimumPruneSize)
+            _pruneAt = minimumPruneSize;
+    }
+
+private:
+    static size_t const minimumPruneSize = 1024;
+
+    mutable QReadWriteLock _lock;
+
+    std::unordered_map<Key, std::weak_ptr<InternedDescriptor const>> _entries;
+
+    size_t _pruneAt;
+};
+
+
+template <class T>
+DaemonKeyIndex<typename T::Key> & getDaemonKeyIndex () {
+    static DaemonKeyIndex<typename T::Key> index;
+    return index;
+}
+
+
+template <class T, class... Args>
+optional<ThinkerPresentBase> DaemonBase::tryGetDaemonPresentFor (
+    optional<DaemonPriority> priority,
+    Args &&... args
+) {
+    return tryGetDaemonPresentFor<T>(
+        std::integral_constant<
+            bool, not std::is_void<typename T::Key>::value
+        >(),
+        priority,
+        std::forward<Args>(args)...
+    );
+}
+
+
+template <class T, class... Args>
+optional<ThinkerPresentBase> DaemonBase::tryGetDaemonPresentFor (
+    std::false_type,
+    optional<DaemonPriority> priority,
+    Args &&... args
+) {
+    DaemonRequest request = makeDaemonRequest<T>(std::forward<Args>(args)...);
+
+    return tryGetDaemonPresentPrivate(
+        std::move(request.descriptor),
+        request.factory,
+        *request.info,
+        priority
+    );
+}
+
+
+template <class T, class... Args>
+optional<ThinkerPresentBase> DaemonBase::tryGetDaemonPresentFor (
+    std::true_type,
+    optional<DaemonPriority> priority,
+    Args &&... args
+) {
+    typename T::Key key = T::makeKey(args...);
+
+    auto & index = getDaemonKeyIndex<T>();
+
+    shared_ptr<InternedDescriptor const> interned = index.tryFind(key);
+    if (interned) {
+        optional<ThinkerPresentBase> present
+            = tryGetInternedDaemonPresentPrivate(interned, typeid(T), priority);
+        if (present)
+            return present;
+    }
+
+    DaemonRequest request = makeDaemonRequest<T>(std::forward<Args>(args)...);
+
+    optional<ThinkerPresentBase> present = tryGetDaemonPresentPrivate(
+        std::move(request.descriptor),
+        request.factory,
+        *request.info,
+        priority,
+        &interned
+    );
+
+    if (present and interned)
+        index.remember(key, interned);
+
+    return present;
+}
+
+
+template <class T, class... Args>
+optional<ThinkerPresentBase> DaemonBase::tryGetStaleDaemonPresentFor (
+    quint64 & generation,
+    Args &&... args
+) {
+    return tryGetStaleDaemonPresentFor<T>(
+        std::integral_constant<
+            bool, not std::is_void<typename T::Key>::value
+        >(),
+        generation,
+        std::forward<Args>(args)...
+    );
+}
+
+
+template <class T, class... Args>
+optional<ThinkerPresentBase> DaemonBase::tryGetStaleDaemonPresentFor (
+    std::false_type,
+    quint64 & generation,
+    Args &&... args
+) {
+    DaemonRequest request = makeDaemonRequest<T>(std::forward<Args>(args)...);
+
+    return tryGetStaleDaemonPresentPrivate(
+        request.descriptor, *request.info, generation
+    );
+}
+
+
+// Stale results hold on to their interned descriptor, so if the key was
+// ever remembered it can still be found.  When it can't, there's nothing
+// for it but to pack the descriptor.
+
+template <class T, class... Args>
+optional<ThinkerPresentBase> DaemonBase::tryGetStaleDaemonPresentFor (
+    std::true_type,
+    quint64 & generation,
+    Args &&... args
+) {
+    shared_ptr<InternedDescriptor const> interned
+        = getDaemonKeyIndex<T>().tryFind(T::makeKey(args...));
+    if (interned)
+        return tryGetStaleInternedPresentPrivate(
+            interned, typeid(T), generation
+        );
+
+    return tryGetStaleDaemonPresentFor<T>(
+        std::false_type(), generation, std::forward<Args>(args)...
+    );
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::prefetchDaemons()
+//
+// Asks for Daemons to be made available without wanting a snapshot of them
+// right now.  Any that don't exist yet are queued for creation, and those
+// that do are marked as recently requested (so they look like poor
+// candidates for being freed).  Used by the Worker on behalf of Operations
+// that declare what they will need when rendered or invoked.
+//
+
+void prefetchDaemons (std::vector<DaemonRequest> && requests);
+
+
+
 ///////////////////////////////////////////////////////////////////////////////
 //
 // benzene::trySnapshotDaemon()
@@ -327,28 +1119,15 @@ optional<typename T::Snapshot> trySnapshotDaemon(
         "trySnapshotDaemon<>() must be parameterized with a Daemon class"
     );
 
-    DaemonFactory factory (
-        [] (methyl::Node<Descriptor const> descriptor) {
-            return unique_ptr<ThinkerBase> (
-                new T (T::unpackDescriptor(descriptor))
-            );
-        }
-    );
-
-    methyl::Tree<Descriptor> descriptor = T::packDescriptor (
-        std::forward<Args>(args)...
-    );
-
-    // If this thread is actually a Daemon thread requesting, this call may
-    // be blocking - as when one Daemon depends upon another there is no
-    // incrementality at this time.  This may be a breaking assumption for
-    // the architecture--it would mean for instance that a long palette
-    // computation could hold up the entirety of an outline operation
-    // that depended on that outline.
+    // If this thread is actually a Daemon thread requesting, a nullopt (or
+    // a snapshot of a Daemon that isn't complete) is remembered; should the
+    // Daemon then return Dependent, it is parked until the Daemons it asked
+    // for have all completed.
 
-    optional<ThinkerPresentBase> presentBase = T::tryGetDaemonPresentPrivate (
-        std::move(descriptor), factory, typeid(T)
-    );
+    optional<ThinkerPresentBase> presentBase
+        = DaemonBase::tryGetDaemonPresentFor<T>(
+            nullopt, std::forward<Args>(args)...
+        );
 
     // There wasn't a Daemon matching this descriptor available (yet)
     // It should have been put into the creation queue where the factory
@@ -361,6 +1140,254 @@ optional<typename T::Snapshot> trySnapshotDaemon(
     return (typename T::Present (*presentBase)).createSnapshot();
 }
 
+
+// The same, but with a stated priority instead of the one inferred from
+// the calling thread.  e.g. a render of something offscreen might ask at
+// Background so it doesn't hold up what the user is actually looking at.
+
+template <class T, class... Args>
+optional<typename T::Snapshot> trySnapshotDaemonAtPriority (
+    DaemonPriority priority,
+    Args &&... args
+) {
+    static_assert(
+        std::is_base_of<DaemonBase, T>::value,
+        "trySnapshotDaemonAtPriority<>() must be parameterized with a Daemon"
+    );
+
+    optional<ThinkerPresentBase> presentBase
+        = DaemonBase::tryGetDaemonPresentFor<T>(
+            priority, std::forward<Args>(args)...
+        );
+
+    if (not presentBase)
+        return nullopt;
+
+    return (typename T::Present (*presentBase)).createSnapshot();
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::trySnapshotDaemonMaybeStale()
+//
+// After an edit, the Daemons it affected are thrown out, so something that
+// draws their results would have nothing to draw until replacements are
+// done.  For a Daemon whose DaemonData is served stale, this gives the old
+// results until then.  The generation says which version of the document
+// a snapshot was computed against, so a render can show that it's behind.
+//
+// A complete Daemon is always preferred.  Failing that, stale results win
+// over a partial snapshot of the replacement...and if there aren't any,
+// that partial snapshot (not stale) is what's given.  As with the others,
+// a missing Daemon is queued for creation.
+//
+
+template <class T>
+struct MaybeStaleSnapshot {
+    typename T::Snapshot snapshot;
+
+    bool isStale;
+
+    quint64 generation;
+};
+
+
+template <class T, class... Args>
+optional<MaybeStaleSnapshot<T>> trySnapshotDaemonMaybeStale (
+    Args &&... args
+) {
+    static_assert(
+        std::is_base_of<DaemonBase, T>::value,
+        "trySnapshotDaemonMaybeStale<>() must be parameterized with a Daemon"
+    );
+
+    optional<ThinkerPresentBase> presentBase
+        = DaemonBase::tryGetDaemonPresentFor<T>(nullopt, args...);
+
+    if (presentBase and DaemonBase::isCompletePrivate(*presentBase)) {
+        return MaybeStaleSnapshot<T> {
+            (typename T::Present (*presentBase)).createSnapshot(),
+            false,
+            DaemonBase::getGenerationPrivate(*presentBase)
+        };
+    }
+
+    quint64 staleGeneration = 0;
+    optional<ThinkerPresentBase> staleBase
+        = DaemonBase::tryGetStaleDaemonPresentFor<T>(
+            staleGeneration, std::forward<Args>(args)...
+        );
+
+    if (staleBase) {
+        return MaybeStaleSnapshot<T> {
+            (typename T::Present (*staleBase)).createSnapshot(),
+            true,
+            staleGeneration
+        };
+    }
+
+    if (not presentBase)
+        return nullopt;
+
+    return MaybeStaleSnapshot<T> {
+        (typename T::Present (*presentBase)).createSnapshot(),
+        false,
+        DaemonBase::getGenerationPrivate(*presentBase)
+    };
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::snapshotDaemonWithin()
+//
+// A render that misses a Daemon by a couple of milliseconds has to draw a
+// placeholder, and then the whole thing again once the Daemon finishes.
+// This waits up to the given time for the Daemon to complete, asking for
+// it as Interactive in the meantime (which also boosts anything it is
+// waiting on).  If time runs out, it gives back whatever trySnapshotDaemon
+// would have: a partial snapshot if the Daemon exists, else nullopt.
+//
+// Not for use on Daemon threads; a Daemon should return Dependent instead
+// of holding onto a thread from the pool.  Nor inside invoke() of an
+// operation without a WriteSet, where every Daemon is paused and none can
+// be created until invoke() returns.  With a WriteSet, only the Daemons
+// observing what it writes are paused, but creation still waits for the
+// window to end, so this only helps for Daemons that already exist.  Use
+// it from prepare() of a two-phase operation instead (or from a render).
+//
+
+template <class T, class... Args>
+optional<typename T::Snapshot> snapshotDaemonWithin (
+    unsigned long msecs,
+    Args &&... args
+) {
+    static_assert(
+        std::is_base_of<DaemonBase, T>::value,
+        "snapshotDaemonWithin<>() must be parameterized with a Daemon class"
+    );
+
+    QElapsedTimer timer;
+    timer.start();
+
+    while (true) {
+        quint64 epoch = DaemonBase::getSettleEpochPrivate();
+
+        optional<ThinkerPresentBase> presentBase
+            = DaemonBase::tryGetDaemonPresentFor<T>(
+                DaemonPriority::Interactive, args...
+            );
+
+        qint64 remaining = static_cast<qint64>(msecs) - timer.elapsed();
+
+        if (
+            presentBase
+            and (DaemonBase::isCompletePrivate(*presentBase) or remaining <= 0)
+        ) {
+            return (typename T::Present (*presentBase)).createSnapshot();
+        }
+
+        if (remaining <= 0)
+            return nullopt;
+
+        DaemonBase::waitForSettlePrivate(epoch, remaining);
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::trySnapshotDaemons()
+//
+// For when a render or Daemon needs a lot of Daemons at once, possibly of
+// different types.  The requests are all looked up together, while the
+// shards of the map they're in are locked, and any that are missing are
+// queued for creation in one go.
+//
+// Everything found is valid for the same version of the document, whose
+// generation is given.  A Daemon still being checked after an edit counts
+// as pending (though it isn't queued, since it exists).  The results are
+// gotten with the type each was requested as:
+//
+//     auto snapshots = trySnapshotDaemons(std::move(requests));
+//     auto outline = snapshots.get<OutlineDaemon>(0);
+//
+// Snapshots are taken on get(), which can be later than the lookup.  That
+// doesn't change what generation they are valid for: any Daemon the edit
+// made invalid is cancelled, not updated, and the rest are still right.
+// But it does mean they aren't taken all at one instant.  Two Daemons that
+// are still running may be seen at different points in their progress,
+// and one that completes in between two get() calls may be complete in
+// the second snapshot but not the first.  Only the document version is
+// guaranteed to be shared.
+//
+
+class DaemonSnapshots {
+public:
+    quint64 getGeneration () const {
+        return _generation;
+    }
+
+    std::vector<size_t> const & getPending () const {
+        return _pending;
+    }
+
+    template <class T>
+    optional<typename T::Snapshot> get (size_t index) const {
+        hopefully(*_infos[index] == typeid(T), HERE);
+
+        if (not _presents[index])
+            return nullopt;
+
+        return (typename T::Present (*_presents[index])).createSnapshot();
+    }
+
+friend DaemonSnapshots trySnapshotDaemons (
+    std::vector<DaemonRequest> && requests
+);
+private:
+    quint64 _generation;
+
+    std::vector<optional<ThinkerPresentBase>> _presents;
+
+    std::vector<std::type_info const *> _infos;
+
+    std::vector<size_t> _pending;
+};
+
+
+DaemonSnapshots trySnapshotDaemons (std::vector<DaemonRequest> && requests);
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::tryGetDaemonProgress()
+//
+// For showing a progress indicator in place of a Daemon's results while it
+// is still working.  As with trySnapshotDaemon, asking about a Daemon which
+// doesn't exist yet will queue its creation and return nullopt.
+//
+
+template <class T, class... Args>
+optional<DaemonProgress> tryGetDaemonProgress (
+    Args &&... args
+) {
+    optional<ThinkerPresentBase> presentBase
+        = DaemonBase::tryGetDaemonPresentFor<T>(
+            nullopt, std::forward<Args>(args)...
+        );
+
+    if (not presentBase)
+        return nullopt;
+
+    return T::getProgressPrivate(*presentBase);
+}
+
 } // end namespace benzene
 
 Q_DECLARE_METATYPE(benzene::DaemonFactory)
@@ -40,9 +40,18 @@
 #include "methyl/accessor.h"
 
 #include "benzene/application.h"
+#include "benzene/daemon.h"
 
 namespace benzene {
 
+// A WriteSet lists the roots of the document subtrees an operation may
+// modify.  The roots themselves must still be in the document after the
+// operation runs (it may change their content and descendants, but not
+// remove them), which is what lets the framework reason about who was
+// affected after the fact...and put the subtrees back for an undo.
+
+typedef std::vector<methyl::Node<methyl::Accessor>> WriteSet;
+
 
 //////////////////////////////////////////////////////////////////////////////
 //
@@ -61,6 +70,74 @@ public:
 public:
     virtual optional<methyl::Tree<methyl::Error>> invoke() const = 0;
 
+    // Analysis that only reads the document shouldn't have to happen with
+    // every daemon paused.  A two-phase operation does that work in
+    // prepare(), which runs while daemons are still going (so it may wait
+    // on their results), and stores what it intends to change.  invoke()
+    // then only applies that stored change set, under the pause.  Both
+    // are run on the worker one right after the other, so the document
+    // can't change in between.
+    //
+    // prepare() must not write to the document; read it through
+    // getApplication().getDocument() rather than getDocument().
+
+    virtual bool isTwoPhase() const { return false; }
+
+    virtual optional<methyl::Tree<methyl::Error>> prepare() {
+        return nullopt;
+    }
+
+    // A cancellable operation promises to check wasPauseRequested() while
+    // it works, and return (with any error) soon after it says true.  The
+    // framework keeps a copy of what was there from just before invoke(),
+    // and if the user pressed Cancel it is put back, so whatever partial
+    // changes were made are undone.  (With a WriteSet only those subtrees
+    // are copied; without one, the whole document is.)  Operations run
+    // after a cancellation in the same batch are skipped.
+
+    virtual bool isCancellable() const { return false; }
+
+    // While the user is hovering over an operation, the framework may run
+    // invoke() ahead of time against a private fork of the document, so
+    // that rendering can show the actual result instead of guessing at it.
+    // If the button is then released on the same hit, the fork becomes
+    // the document and invoke() is not run again.  Only operations whose
+    // invoke() depends on nothing but the document (no clocks, no dialogs,
+    // no external files) should answer true here.
+    //
+    // The daemons are not paused for a speculative invoke(), so every write
+    // must go through getDocument(), which hands out the fork.  Writing by
+    // way of the nodes the operation was made with would change the real
+    // document underneath them.  An operation that does that must answer
+    // false.  Likewise a two-phase operation gets prepare() run against the
+    // real document first, so what it stores must be something invoke() can
+    // find again starting from getDocument() (a path, an index, a tag), not
+    // the nodes themselves.
+
+    virtual bool isSpeculatable() const { return false; }
+
+    // Rendering feedback for an operation (and the operation itself, once
+    // invoked) often depends on Daemons that won't be requested until the
+    // render asks for them.  By the time the user has glanced at something
+    // we have a good guess as to what is coming, so an operation can list
+    // the Daemons it expects to need and they will be started early.  Use
+    // makeDaemonRequest<DaemonType>(args...) to build the entries.
+
+    virtual std::vector<DaemonRequest> getDaemonsToPrefetch() const {
+        return std::vector<DaemonRequest> ();
+    }
+
+    // Before invoke() all daemons must be paused, since the operation may
+    // free nodes out from under them.  An operation that can say up front
+    // which subtrees it will write lets the framework pause only daemons
+    // that are observing those subtrees, and leave the rest running.  The
+    // default of nullopt means "anywhere in the document", which also
+    // means the whole document gets copied for the undo history.
+
+    virtual optional<WriteSet> getWriteSet() const {
+        return nullopt;
+    }
+
 public:
     methyl::Node<methyl::Accessor> getDocument() const;
 
@@ -66,12 +66,17 @@ private slots:
 
     void showError (QString message);
 
+    // Hidden unless an operation is running and has reported progress
+    void showProgress (optional<float> fraction);
+
 
 private:
     QLabel * _statusBarIcon;
 
     QLabel * _statusBarMessage;
 
+    QProgressBar * _statusBarProgress;
+
 
 private:
     // Loading Pixmaps from the resource file takes time, so we only want to
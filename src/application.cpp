@@ -23,6 +23,7 @@
 #include <vector>
 
 #include <QMessageBox>
+#include <QDir>
 #include <QThread>
 
 #include "benzene/operationstatusbar.h"
@@ -244,6 +245,18 @@ void ApplicationBase::onWorkerInitializeComplete () {
         &getWorker(), &Worker::receiveLastHit
     );
 
+    connect(
+        this, &ApplicationBase::undoRequested,
+        &getWorker(), &Worker::onUndoRequest,
+        Qt::QueuedConnection
+    );
+
+    connect(
+        this, &ApplicationBase::redoRequested,
+        &getWorker(), &Worker::onRedoRequest,
+        Qt::QueuedConnection
+    );
+
     // first time we'll exit the ::exec() loop
     exit(execResultInternal);
 }
@@ -431,7 +444,17 @@ void ApplicationBase::queueInvokeOperationMaybe (
     unique_ptr<OperationBase> && operation
 ) const
 {
-    emit getWorker().queueInvokeOperationMaybe(operation.release());
+    getWorker().queueInvokeOperationMaybe(std::move(operation));
+}
+
+
+void ApplicationBase::queueUndo () const {
+    emit undoRequested();
+}
+
+
+void ApplicationBase::queueRedo () const {
+    emit redoRequested();
 }
 
 
@@ -449,8 +472,44 @@ Node<Accessor const> ApplicationBase::getDocument () const {
 }
 
 
-void ApplicationBase::onBeginInvokeOperation (QString const & message) {
+auto ApplicationBase::getPreviewDocument () const
+    -> optional<Node<Accessor const>>
+{
+    WORKER
+
+    Worker & worker = getWorker();
+
+    if (not worker._speculativeDocument)
+        return nullopt;
+
+    return methyl::globalEngine->contextualNodeRef(
+        (*worker._speculativeDocument).root(),
+        methyl::globalEngine->contextForLookup()
+    );
+}
+
+
+quint64 ApplicationBase::getDocumentGeneration () const {
+    return getWorker()._documentGeneration;
+}
+
+
+void ApplicationBase::setDaemonMemoryBudget (size_t bytes) {
+    getWorker()._daemonManagerThread->getManager().setMemoryBudget(bytes);
+}
+
+
+void ApplicationBase::setDaemonCacheDirectory (QString const & path) {
+    QDir().mkpath(path);
+
+    getWorker()._daemonManagerThread->getManager().setCacheDirectory(path);
+}
+
 
+void ApplicationBase::onBeginInvokeOperation (
+    QString const & message,
+    bool cancellable
+) {
     GUI
 
     for (OperationStatusBar * statusBar : _statusBars) {
@@ -462,6 +521,53 @@ void ApplicationBase::onBeginInvokeOperation (QString const & message) {
 
     _runDialog = make_unique<RunDialog>(&getWorker().getMainWidget());
     _runDialog->setProgressString(message);
+    _runDialog->setCancellable(cancellable);
+
+    // The worker is busy running the operation and won't service queued
+    // signals, so the request is made directly; it only sets a flag that
+    // the operation polls through wasPauseRequested().
+
+    connect(
+        _runDialog.get(), &RunDialog::canceled,
+        this, [this]() {
+            getWorker().requestCancel();
+            _runDialog->setProgressString("Canceling...");
+        }
+    );
+
+    _progressTimer = make_unique<QTimer>();
+
+    connect(
+        _progressTimer.get(), &QTimer::timeout,
+        this, &ApplicationBase::onProgressTimer
+    );
+
+    _progressTimer->start(Worker::msecPerceivable);
+}
+
+
+void ApplicationBase::onProgressTimer () {
+    GUI
+
+    Worker & worker = getWorker();
+
+    optional<float> fraction;
+    int permyriad = worker._progressPermyriad;
+    if (permyriad >= 0)
+        fraction = permyriad / 10000.0f;
+
+    QString phase;
+    {
+        QMutexLocker lock (&worker._progressPhaseMutex);
+        phase = worker._progressPhase;
+    }
+
+    if (_runDialog)
+        _runDialog->setProgress(fraction, phase);
+
+    for (OperationStatusBar * statusBar : _statusBars) {
+        statusBar->showProgress(fraction);
+    }
 }
 
 
@@ -472,6 +578,8 @@ void ApplicationBase::onEndInvokeOperation (
 
     GUI
 
+    _progressTimer.reset();
+
     connect(
         _runDialog.get(), &RunDialog::okayToClose,
         this, [&]() {
@@ -706,17 +814,21 @@ bool wasPauseRequested (unsigned long time) {
     // Daemon Manager should *definitely* never be calling this...
     hopefully(not isDaemonManagerThreadCurrent(), HERE);
 
+    auto & app = getApplication<ApplicationBase>();
+
     if (isWorkerThreadCurrent()) {
-        // Should return the cancel state of the RunDialog if there is one,
-        // otherwise cancellation should not be possible (during rendering
-        // or whatever else is being done on the worker.
+        // This is the cancel state of the RunDialog if there is one.  The
+        // flag is cleared before each batch of operations is invoked, so
+        // during rendering or whatever else is being done on the worker it
+        // will just say false.  Operations that didn't agree to be canceled
+        // aren't told at all, and run to the end.
 
-        // for now we'll just say false.
+        Q_UNUSED(time);
 
-        return false;
-    }
+        Worker & worker = app.getWorker();
 
-    auto & app = getApplication<ApplicationBase>();
+        return worker._cancelRequested and worker._isCancelObservable;
+    }
 
     DaemonManager & manager
         = *(app.getWorker()._daemonManagerThread->_daemonManager);
@@ -732,5 +844,59 @@ bool wasPauseRequested (unsigned long time) {
     return thinker->wasPauseRequested(time);
 }
 
+
+void reportProgress (float fraction, QString const & phase) {
+
+    // Same callers as wasPauseRequested: client code for operations or
+    // daemons, and never the GUI or the Daemon Manager
+    hopefully(not isGuiThreadCurrent(), HERE);
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    int permyriad = qBound(0, static_cast<int>(fraction * 10000), 10000);
+
+    auto & app = getApplication<ApplicationBase>();
+
+    if (isWorkerThreadCurrent()) {
+        Worker & worker = app.getWorker();
+
+        // Scale into this operation's slice of the batch
+
+        worker._progressPermyriad = (
+            10000 * worker._progressOperationIndex + permyriad
+        ) / worker._progressOperationCount;
+
+        if (not phase.isNull()) {
+            QMutexLocker lock (&worker._progressPhaseMutex);
+            worker._progressPhase = phase;
+        }
+        return;
+    }
+
+    DaemonManager & manager
+        = *(app.getWorker()._daemonManagerThread->_daemonManager);
+
+    ThinkerBase const * thinker
+        = manager.getThinkerForThreadMaybeNull(*QThread::currentThread());
+
+    if (thinker == nullptr) {
+        // not operation, not daemon... who called this, and why?
+        throw hopefullyNotReached(HERE);
+    }
+
+    // The ThinkerManager only hands out const access, but the progress
+    // fields are atomic or locked and belong to the Daemon itself.
+
+    DaemonBase & daemon = const_cast<DaemonBase &>(
+        dynamic_cast<DaemonBase const &>(*thinker)
+    );
+
+    daemon._progressPermyriad = permyriad;
+
+    if (not phase.isNull()) {
+        QMutexLocker lock (&daemon._progressPhaseMutex);
+        daemon._progressPhase = phase;
+    }
+}
+
 } // end namespace benzene
 
@@ -19,6 +19,11 @@
 // See http://benzene.hostilefork.com/ for more information on this project
 //
 
+#include <algorithm>
+#include <climits>
+
+#include <QSaveFile>
+
 #include "benzene/daemon.h"
 
 #include "worker.h"
@@ -32,7 +37,19 @@ namespace benzene {
 
 DaemonBase::DaemonBase () :
     _observer (),
-    _needsRequeue (false)
+    _generation (0),
+    _isDiscarded (false),
+    _lastRequestTick (0),
+    _msecsUsed (0),
+    _approximateSize (0),
+    _isComplete (false),
+    _key {nullptr, 0},
+    _isSeeded (false),
+    _serial (0),
+    _isParked (false),
+    _prerequisitesPending (0),
+    _priority (static_cast<int>(DaemonPriority::Background)),
+    _progressPermyriad (-1)
 {
 }
 
@@ -52,14 +69,205 @@ ThinkerManager & DaemonBase::getThinkerManager () {
 optional<ThinkerPresentBase> DaemonBase::tryGetDaemonPresentPrivate (
     methyl::Tree<Descriptor> && descriptor,
     DaemonFactory factory,
-    std::type_info const & info
+    std::type_info const & info,
+    optional<DaemonPriority> priority,
+    shared_ptr<InternedDescriptor const> * internedOut
 ) {
     // requests can come from ENGINE, GUI, or DAEMON
     hopefully(not isDaemonManagerThreadCurrent(), HERE);
 
     return getDaemonManager().tryGetDaemonPresent(
-        std::move(descriptor), factory, info
+        std::move(descriptor), factory, info, priority, internedOut
+    );
+}
+
+
+optional<ThinkerPresentBase> DaemonBase::tryGetInternedDaemonPresentPrivate (
+    shared_ptr<InternedDescriptor const> const & descriptor,
+    std::type_info const & info,
+    optional<DaemonPriority> priority
+) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    return getDaemonManager().tryGetInternedDaemonPresent(
+        descriptor, info, priority
+    );
+}
+
+
+optional<ThinkerPresentBase> DaemonBase::tryGetStaleDaemonPresentPrivate (
+    methyl::Tree<Descriptor> const & descriptor,
+    std::type_info const & info,
+    quint64 & generation
+) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    return getDaemonManager().tryGetStaleDaemonPresent(
+        descriptor, info, generation
+    );
+}
+
+
+optional<ThinkerPresentBase> DaemonBase::tryGetStaleInternedPresentPrivate (
+    shared_ptr<InternedDescriptor const> const & descriptor,
+    std::type_info const & info,
+    quint64 & generation
+) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    return getDaemonManager().tryGetStaleInternedPresent(
+        descriptor, info, generation
+    );
+}
+
+
+optional<DaemonProgress> DaemonBase::getProgressPrivate (
+    ThinkerPresentBase & present
+) {
+    DaemonBase & daemon = getDaemonManager().getDaemon(present);
+
+    DaemonProgress progress;
+
+    int permyriad = daemon._progressPermyriad;
+    if (permyriad >= 0)
+        progress.fraction = permyriad / 10000.0f;
+
+    QMutexLocker lock (&daemon._progressPhaseMutex);
+    progress.phase = daemon._progressPhase;
+
+    return progress;
+}
+
+
+quint64 DaemonBase::getGeneration () const {
+    if (_isDiscarded)
+        return _generation;
+
+    return std::max<quint64>(
+        _generation, getDaemonManager().getResumedGeneration()
+    );
+}
+
+
+bool DaemonBase::isCompletePrivate (ThinkerPresentBase & present) {
+    return getDaemonManager().getDaemon(present)._isComplete;
+}
+
+
+quint64 DaemonBase::getGenerationPrivate (ThinkerPresentBase & present) {
+    return getDaemonManager().getDaemon(present).getGeneration();
+}
+
+
+quint64 DaemonBase::getSettleEpochPrivate () {
+    return getDaemonManager().getSettleEpoch();
+}
+
+
+void DaemonBase::waitForSettlePrivate (quint64 epoch, unsigned long msecs) {
+    hopefully(not isDaemonThreadCurrent(), HERE);
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    // In a full pause (as during invoke() of an operation without a
+    // WriteSet) nothing runs and nothing is created until the worker ends
+    // the window, which it can't do while it's waiting here.  The worker
+    // is the one who starts and ends windows, so it can read the flag.
+
+    if (isWorkerThreadCurrent())
+        hopefully(not getDaemonManager()._isFullPause, HERE);
+
+    getDaemonManager().waitForSettle(epoch, msecs);
+}
+
+
+void DaemonBase::writeCacheFile (
+    QString const & path,
+    QByteArray const & bytes
+) {
+    DAEMON
+
+    // Written under a temporary name and renamed, so a crash or another
+    // instance reading at the same moment never sees half a file.  A
+    // failure just means the next session computes it again.
+
+    QSaveFile file (path);
+    if (not file.open(QIODevice::WriteOnly))
+        return;
+
+    file.write(bytes);
+    file.commit();
+}
+
+
+void DaemonBase::beginRun () {
+    DAEMON
+
+    _isParked = false;
+    _awaiting.clear();
+}
+
+
+bool DaemonBase::park () {
+    DAEMON
+
+    // Saying Dependent without having been turned away by any snapshot
+    // would park the Daemon with nothing that could ever wake it.
+    hopefully(not _awaiting.empty(), HERE);
+
+    _isParked = true;
+
+    emit getDaemonManager().daemonParked(
+        _serial,
+        std::vector<DaemonKey> (begin(_awaiting), end(_awaiting))
     );
+
+    // A pause window or a cancellation asks too, and we're resumed or
+    // thrown out at its end.
+
+    waitToBePaused();
+
+    // Not finished; it will be called again through resume().
+    return false;
+}
+
+
+void DaemonBase::waitToBePaused () {
+    DAEMON
+
+    // ULONG_MAX is how Qt says to wait without a timeout.  Anything that
+    // wakes us without the request just goes back to waiting.
+
+    while (not wasPauseRequested(ULONG_MAX)) {
+    }
+}
+
+
+bool DaemonBase::awaitPrerequisites () {
+    DAEMON
+
+    if (_prerequisitesPending == 0)
+        return false;
+
+    // Parked the same way as for Dependent, with nothing in particular to
+    // wait on; the manager checks the count once it has us paused, so the
+    // last prerequisite finishing in the meantime isn't missed.
+
+    _isParked = true;
+
+    emit getDaemonManager().daemonParked(_serial, std::vector<DaemonKey> ());
+
+    waitToBePaused();
+
+    return true;
+}
+
+
+void DaemonBase::announceCompletion () {
+    DAEMON
+
+    emit getDaemonManager().daemonCompleted(_serial);
+
+    getDaemonManager().notifySettled();
 }
 
 
@@ -77,4 +285,55 @@ DaemonBase::~DaemonBase () {
 }
 
 
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::prefetchDaemons()
+//
+
+void prefetchDaemons (std::vector<DaemonRequest> && requests) {
+    // Nobody is waiting on these yet, so unless the caller said otherwise
+    // they shouldn't get in the way of anything that somebody is.
+
+    for (DaemonRequest & request : requests) {
+        DaemonBase::tryGetDaemonPresentPrivate(
+            std::move(request.descriptor),
+            request.factory,
+            *request.info,
+            request.priority
+                ? *request.priority
+                : DaemonPriority::Speculative
+        );
+    }
+}
+
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::trySnapshotDaemons()
+//
+
+DaemonSnapshots trySnapshotDaemons (std::vector<DaemonRequest> && requests) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    DaemonSnapshots result;
+
+    result._infos.reserve(requests.size());
+    for (DaemonRequest const & request : requests)
+        result._infos.push_back(request.info);
+
+    result._presents = DaemonBase::getDaemonManager().tryGetDaemonPresents(
+        std::move(requests), result._generation
+    );
+
+    for (size_t index = 0; index < result._presents.size(); index++) {
+        if (not result._presents[index])
+            result._pending.push_back(index);
+    }
+
+    return result;
+}
+
+
 } // end namespace benzene
@@ -19,6 +19,12 @@
 // See http://benzene.hostilefork.com/ for more information on this project
 //
 
+#include <algorithm>
+
+#include <QDir>
+#include <QFile>
+#include <QCryptographicHash>
+
 #include "worker.h"
 #include "benzene/daemon.h"
 
@@ -94,8 +100,20 @@ DaemonManagerThread::~DaemonManagerThread () {
 // benzene::DaemonManager
 //
 
-DaemonManager::DaemonManager () {
+DaemonManager::DaemonManager () :
+    _nextPendingSequence (0),
+    _isWakePending (false),
+    _nextSerial (1),
+    _isFullPause (false),
+    _settleEpoch (0),
+    _resumedGeneration (0),
+    _isSelectivePause (false),
+    _memoryBudget (defaultMemoryBudget),
+    _contentDigestGeneration (0)
+{
     qRegisterMetaType<DaemonFactory>("DaemonFactory");
+    qRegisterMetaType<WriteSet>("WriteSet");
+    qRegisterMetaType<std::vector<DaemonKey>>("std::vector<DaemonKey>");
 
     connect(
         this, &ThinkerManager::anyThinkerWritten,
@@ -104,8 +122,26 @@ DaemonManager::DaemonManager () {
     );
 
     connect(
-        this, &DaemonManager::daemonCreateRequest,
-        this, &DaemonManager::onDaemonCreateRequest,
+        this, &DaemonManager::pendingCreationsQueued,
+        this, &DaemonManager::onPendingCreations,
+        Qt::QueuedConnection
+    );
+
+    connect(
+        this, &DaemonManager::daemonParked,
+        this, &DaemonManager::onDaemonParked,
+        Qt::QueuedConnection
+    );
+
+    connect(
+        this, &DaemonManager::daemonCompleted,
+        this, &DaemonManager::onDaemonCompleted,
+        Qt::QueuedConnection
+    );
+
+    connect(
+        this, &DaemonManager::priorityRaised,
+        this, &DaemonManager::onPriorityRaised,
         Qt::QueuedConnection
     );
 
@@ -115,42 +151,189 @@ DaemonManager::DaemonManager () {
         Qt::BlockingQueuedConnection
     );
 
+    connect(
+        this, &DaemonManager::ensureAffectedDaemonsPausedBlocking,
+        this, &DaemonManager::onEnsureAffectedDaemonsPausedBlocking,
+        Qt::BlockingQueuedConnection
+    );
+
     connect(
         this, &DaemonManager::ensureDaemonsResumedBlocking,
         this, &DaemonManager::onEnsureDaemonsResumedBlocking,
         Qt::BlockingQueuedConnection
     );
+
+    connect(
+        this, &DaemonManager::ensureDaemonsDiscardedBlocking,
+        this, &DaemonManager::onEnsureDaemonsDiscardedBlocking,
+        Qt::BlockingQueuedConnection
+    );
+
+    // We're constructed on the DaemonManagerThread, so that's where the
+    // timer will fire.
+
+    _collectTimer = make_unique<QTimer>();
+
+    connect(
+        _collectTimer.get(), &QTimer::timeout,
+        this, &DaemonManager::onCollectGarbage
+    );
+
+    _collectTimer->start(msecCollectInterval);
+
+    _agingTimer = make_unique<QTimer>();
+
+    connect(
+        _agingTimer.get(), &QTimer::timeout,
+        this, &DaemonManager::rebalancePriorities
+    );
+
+    _agingTimer->start(msecAgedSlice);
 }
 
 
 
-optional<ThinkerPresentBase> DaemonManager::createOrRequeueDaemon (
+optional<ThinkerPresentBase> DaemonManager::queueDaemonCreation (
     methyl::Tree<Descriptor> && descriptor,
+    size_t descriptorHash,
     DaemonFactory factory,
     std::type_info const & info,
-    qint64 requestTick
+    qint64 requestTick,
+    DaemonPriority priority
 ) {
     // In the current architectural state, you can snapshot a Daemon from
     // pretty much any thread... including one Daemon snapshotting another.
-    // The only thread we can really rule out is the Daemon Manager, which
-    // will be servicing the creation of the Daemon if that is what's needed
-    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+    // The Daemon Manager only gets here when queueing prerequisites; the
+    // request waits in the pending set like anyone else's.
+
+    QMutexLocker lock (&_pendingMutex);
+
+    addPendingCreation(
+        DaemonKey {&info, descriptorHash},
+        std::move(descriptor),
+        factory,
+        requestTick,
+        priority
+    );
+
+    signalPendingCreations();
+
+    return nullopt;
+}
+
+
+void DaemonManager::addPendingCreation (
+    DaemonKey const & key,
+    methyl::Tree<Descriptor> && descriptor,
+    DaemonFactory factory,
+    qint64 requestTick,
+    DaemonPriority priority
+) {
+    auto range = _pendingKeys.equal_range(key);
+    for (auto itKey = range.first; itKey != range.second; itKey++) {
+        auto it = _pending.find(itKey->second);
+        if (not isPendingDescriptor(it->second, descriptor))
+            continue;
+
+        // Already waiting; the descriptor we were given just goes away.
+        // Its place in line may change, so it's taken out and put back.
+
+        if (
+            (requestTick <= it->second.requestTick)
+            and (priority <= it->second.priority)
+        ) {
+            return;
+        }
+
+        PendingCreation pending = erasePending(it);
+        pending.requestTick = std::max(pending.requestTick, requestTick);
+        pending.priority = std::max(pending.priority, priority);
+        insertPending(std::move(pending));
+        return;
+    }
 
-    unique_ptr<NodePrivate> nodePrivateOwned;
+    unique_ptr<NodePrivate> descriptorOwned;
     shared_ptr<Context> context;
 
-    std::tie(nodePrivateOwned, context)
+    std::tie(descriptorOwned, context)
         = methyl::globalEngine->dissectTree(std::move(descriptor));
 
-    // We have to pass the factory by value, but the lifetime of the
+    // We have to hold the factory by value, but the lifetime of the
     // typeinfo is until end of program:
     //
     //     http://stackoverflow.com/questions/7024818/
-    emit daemonCreateRequest(
-        nodePrivateOwned.release(), context, factory, &info, requestTick
-    );
+    insertPending(PendingCreation {
+        std::move(descriptorOwned),
+        context,
+        factory,
+        key.info,
+        key.descriptorHash,
+        requestTick,
+        priority,
+        _nextPendingSequence++
+    });
+}
 
-    return nullopt;
+
+void DaemonManager::insertPending (PendingCreation && pending) {
+    PendingOrder order = orderOf(pending);
+    DaemonKey key {pending.info, pending.descriptorHash};
+
+    _pendingByAge.insert(order);
+    _pendingKeys.insert(std::make_pair(key, order));
+    _pending.insert(std::make_pair(order, std::move(pending)));
+}
+
+
+bool DaemonManager::isPendingDescriptor (
+    PendingCreation & pending,
+    methyl::Tree<Descriptor> const & descriptor
+) {
+    // Looking at it means taking it into this thread for the moment.  The
+    // mutex keeps anyone else from doing the same meanwhile.
+
+    optional<Tree<Descriptor>> pendingDescriptor
+        = methyl::globalEngine->reconstituteTree<Descriptor>(
+            pending.descriptorOwned.release(), pending.context
+        );
+
+    hopefully(pendingDescriptor != nullopt, HERE);
+
+    bool result = (*pendingDescriptor == descriptor);
+
+    std::tie(pending.descriptorOwned, pending.context)
+        = methyl::globalEngine->dissectTree(std::move(*pendingDescriptor));
+
+    return result;
+}
+
+
+auto DaemonManager::erasePending (PendingMap::iterator it)
+    -> PendingCreation
+{
+    PendingCreation pending = std::move(it->second);
+    DaemonKey key {pending.info, pending.descriptorHash};
+
+    auto range = _pendingKeys.equal_range(key);
+    for (auto itKey = range.first; itKey != range.second; itKey++) {
+        if (itKey->second.sequence == pending.sequence) {
+            _pendingKeys.erase(itKey);
+            break;
+        }
+    }
+
+    _pendingByAge.erase(it->first);
+    _pending.erase(it);
+    return pending;
+}
+
+
+void DaemonManager::signalPendingCreations () {
+    if (_pending.empty() or _isWakePending)
+        return;
+
+    _isWakePending = true;
+    emit pendingCreationsQueued();
 }
 
 
@@ -183,7 +366,9 @@ void DaemonManager::beforeThreadDetach (
 optional<ThinkerPresentBase> DaemonManager::tryGetDaemonPresent (
     methyl::Tree<Descriptor> && descriptor,
     DaemonFactory factory,
-    std::type_info const & info
+    std::type_info const & info,
+    optional<DaemonPriority> priorityOverride,
+    shared_ptr<InternedDescriptor const> * internedOut
 ) {
     // In the current architectural state, you can snapshot a Daemon from
     // pretty much any thread... including one Daemon snapshotting another.
@@ -194,261 +379,2189 @@ optional<ThinkerPresentBase> DaemonManager::tryGetDaemonPresent (
     QElapsedTimer timer;
     timer.start();
 
+    DaemonBase * requester = tryGetRequestingDaemon();
+
+    DaemonPriority priority = priorityOverride
+        ? *priorityOverride
+        : inferPriority(requester);
+
     using methyl::Accessor;
     using methyl::Node;
 
+    size_t descriptorHash = std::hash<Tree<Descriptor>>()(descriptor);
+
+    // Not in the table means not in the map, but a Daemon could have gone
+    // in between the two lookups...so the map lock is taken first.
+
     {
-        QReadLocker lock (&_daemonMapLock);
-        auto itType = _daemonMap.find(&info);
-        if (itType != _daemonMap.end()) {
-            auto it = itType->second.find(descriptor);
+        DaemonMapShard & shard = getShard(descriptorHash);
+
+        QReadLocker lock (&shard.lock);
+        auto interned = _descriptors.tryFind(descriptor, descriptorHash);
+        auto itType = shard.types.find(&info);
+        if (interned and (itType != shard.types.end())) {
+            auto it = itType->second.find(interned);
             if (it != itType->second.end()) {
-                auto & daemon = dynamic_cast<DaemonBase &>(
-                    getThinkerBase(it->second)
-                );
-                daemon._lastRequestTick = timer.msecsSinceReference();
-                if (not daemon._needsRequeue)
-                    return it->second;
+                noteDaemonRequested(it->second, requester, priority);
+
+                if (internedOut != nullptr)
+                    *internedOut = interned;
+
+                return it->second;
             }
         }
     }
 
-    return createOrRequeueDaemon(
-        std::move(descriptor), factory, info, timer.msecsSinceReference()
+    // A Daemon that is turned away here will want to be woken up when
+    // this one exists, if it ends up returning Dependent.
+
+    if (requester != nullptr)
+        requester->_awaiting.insert(DaemonKey {&info, descriptorHash});
+
+    return queueDaemonCreation(
+        std::move(descriptor),
+        descriptorHash,
+        factory,
+        info,
+        timer.msecsSinceReference(),
+        priority
     );
 }
 
 
-void DaemonManager::onDaemonCreateRequest (
-    methyl::NodePrivate * descriptorOwned,
-    shared_ptr<methyl::Context> contextOwned,
-    DaemonFactory factory,
-    std::type_info const * info,
-    qint64 requestTick
+std::vector<optional<ThinkerPresentBase>> DaemonManager::tryGetDaemonPresents (
+    std::vector<DaemonRequest> && requests,
+    quint64 & generation
 ) {
-    DAEMONMANAGER
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
 
-    optional<Tree<Descriptor>> newDescriptor
-        = methyl::globalEngine->reconstituteTree<Descriptor>(
-            descriptorOwned, contextOwned
+    QElapsedTimer timer;
+    timer.start();
+    qint64 requestTick = timer.msecsSinceReference();
+
+    DaemonBase * requester = tryGetRequestingDaemon();
+
+    DaemonPriority inferred = inferPriority(requester);
+
+    std::vector<size_t> hashes;
+    hashes.reserve(requests.size());
+
+    std::array<bool, numDaemonMapShards> involved;
+    involved.fill(false);
+
+    for (DaemonRequest const & request : requests) {
+        size_t hash = std::hash<Tree<Descriptor>>()(request.descriptor);
+        hashes.push_back(hash);
+        involved[hash % numDaemonMapShards] = true;
+    }
+
+    std::vector<optional<ThinkerPresentBase>> results (requests.size());
+    std::vector<size_t> misses;
+
+    // Always locking in shard order, like the DaemonManager's walks do,
+    // means this can't deadlock against them.
+
+    for (size_t shard = 0; shard < numDaemonMapShards; shard++) {
+        if (involved[shard])
+            _daemonMapShards[shard].lock.lockForRead();
+    }
+
+    // Generations only move forward while all the Daemons valid for the
+    // previous one are paused, and carrying survivors forward to the new
+    // one needs these locks.  So what's in the map right now that matches
+    // this generation is all consistent with the document as it is.
+
+    generation = getApplication<ApplicationBase>().getDocumentGeneration();
+
+    for (size_t index = 0; index < requests.size(); index++) {
+        DaemonRequest & request = requests[index];
+        DaemonMapShard & shard = getShard(hashes[index]);
+
+        auto interned = _descriptors.tryFind(
+            request.descriptor, hashes[index]
         );
+        auto itType = shard.types.find(request.info);
+        if (not interned or (itType == shard.types.end())) {
+            misses.push_back(index);
+            continue;
+        }
 
-    hopefully(newDescriptor != nullopt, HERE);
+        auto it = itType->second.find(interned);
+        if (it == itType->second.end()) {
+            misses.push_back(index);
+            continue;
+        }
 
-    auto createPresent = [&](Node<Descriptor const> descriptor)
-        -> ThinkerPresentBase
-    {
-        QElapsedTimer timer;
-        timer.start();
+        noteDaemonRequested(
+            it->second,
+            requester,
+            request.priority ? *request.priority : inferred
+        );
 
-        // This is tricky, because we are being asked to tell the observer
-        // all the roots of trees we want to watch and become invalid if
-        // they are modified.  Technically speaking we'd care if the
-        // descriptor were to change, but it isn't allowed to so we
-        // don't have to mention it.  A Daemon is free to create and
-        // manipulate new nodes, and we wouldn't want creating a node and
-        // observing it then destroying it to count as an invalidation
-        // (the Daemon knew what it was doing, presumably...and this is
-        // not an invalidation of the input to the process...it's no
-        // different than using any other temporary variables)
-        //
-        // So for now we only consider the root of the document (and in
-        // the future this would be the root of all user documents; and
-        // basically any other state which might be considered a relevant
-        // input).  This is still formative, but seems to work for now.
+        if (getDaemon(it->second).getGeneration() == generation)
+            results[index] = it->second;
+        else if (requester != nullptr)
+            requester->_awaiting.insert(getDaemon(it->second)._key);
+    }
 
-        auto & app = getApplication<ApplicationBase>();
-        auto & worker = app.getWorker();
+    for (size_t shard = 0; shard < numDaemonMapShards; shard++) {
+        if (involved[shard])
+            _daemonMapShards[shard].lock.unlock();
+    }
 
-        // The descriptor was created with a different observation context
-        // than we want the Daemon's observations to be using.  So all the
-        // observations need to be made through a new monitoring facility
-        // based on the observer in this Daemon.
+    if (misses.empty())
+        return results;
 
-        auto context = make_shared<Context>(HERE);
-        descriptor = methyl::globalEngine->contextualNodeRef(
-            descriptor, context
+    QMutexLocker lock (&_pendingMutex);
+
+    for (size_t index : misses) {
+        DaemonRequest & request = requests[index];
+        DaemonKey key {request.info, hashes[index]};
+
+        if (requester != nullptr)
+            requester->_awaiting.insert(key);
+
+        addPendingCreation(
+            key,
+            std::move(request.descriptor),
+            request.factory,
+            requestTick,
+            request.priority ? *request.priority : inferred
         );
+    }
 
-        auto observer = methyl::Observer::create(app.getDocument(), HERE);
+    signalPendingCreations();
 
-        {
-            // To keep from blocking the worker, we call the Daemon
-            // constructor from the DaemonManagerThread.  We need to
-            // make sure that Methyl knows to log observations of
-            // data to the observer we're going to put into the Daemon
-            // after creation.
+    return results;
+}
 
-            QWriteLocker lock (&worker._observersLock);
-            worker._threadsToObservers[QThread::currentThread()] = observer;
-        }
 
-        unique_ptr<ThinkerBase> thinker = factory(descriptor);
+optional<ThinkerPresentBase> DaemonManager::tryGetInternedDaemonPresent (
+    shared_ptr<InternedDescriptor const> const & descriptor,
+    std::type_info const & info,
+    optional<DaemonPriority> priorityOverride
+) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
 
-        {
-            // Further running of the Daemon will be from the thread
-            // pool, so remove the association of node observations
-            // from the DaemonManager thread.
+    DaemonBase * requester = tryGetRequestingDaemon();
 
-            QWriteLocker lock (&worker._observersLock);
-            worker._threadsToObservers.remove(QThread::currentThread());
-        }
+    DaemonPriority priority = priorityOverride
+        ? *priorityOverride
+        : inferPriority(requester);
 
-        DaemonBase & daemon = dynamic_cast<DaemonBase &>(*thinker);
+    DaemonMapShard & shard = getShard(descriptor->hash());
 
-        // Set the internal properties.  These "belong" to the manager,
-        // but it's more efficient to poke them into the Daemon itself
-        // to avoid the hash table storage and lookup.
+    QReadLocker lock (&shard.lock);
 
-        daemon._descriptor = descriptor;
-        daemon._context = context;
-        daemon._lastRequestTick = requestTick;
-        daemon._msecsUsed = timer.elapsed();
-        daemon._observer = observer;
+    auto itType = shard.types.find(&info);
+    if (itType == shard.types.end())
+        return nullopt;
 
-        return runBase(std::move(thinker), HERE);
-    };
+    auto it = itType->second.find(descriptor);
+    if (it == itType->second.end())
+        return nullopt;
 
-    QWriteLocker lock (&_daemonMapLock);
-
-    auto newDescriptorRef = (*newDescriptor).root();
-
-    auto itType = _daemonMap.find(info);
-    if (itType == _daemonMap.end()) {
-        _daemonMap[info].insert(std::make_pair(
-            std::move(*newDescriptor), createPresent(newDescriptorRef)
-        ));
-    } else {
-        // It is possible that the same Daemon descriptor will be queued
-        // multiple times before the Daemon creation thread gets around
-        // to doing the creation.  Rather than try and create a data
-        // structure for a queue and avoid inserting duplicates, we
-        // let the duplicates pile up in the thread's event queue.  Then
-        // if a redundant request comes along we just ignore it.  It's
-        // a simple implementation but a little bit "sloppier" than I
-        // usually like :-/ but going with it until there's a problem.
-
-        auto itPair = itType->second.find(*newDescriptor);
-        if (itPair == itType->second.end()) {
-            itType->second.insert(std::make_pair(
-                std::move(*newDescriptor), createPresent(newDescriptorRef)
-            ));
-        } else {
-            // We'll get here if there was a request for this daemon already
-            // serviced -or- if there is a requeue request.
+    noteDaemonRequested(it->second, requester, priority);
 
-            ThinkerPresentBase present;
-            std::tie(std::ignore, present) = *itPair;
+    return it->second;
+}
 
-            DaemonBase & oldDaemon = dynamic_cast<DaemonBase &>(
-                this->getThinkerBase(present)
-            );
 
-            if (oldDaemon._needsRequeue) {
-
-                oldDaemon._needsRequeue = false;
-
-                // In theory we should be able to just set the _needsRequeue
-                // flag here and run the Daemon from continue().  But at the
-                // moment, the run() methods really expect a Thinker to
-                // come in as a unique_ptr; so we sort of have to delete
-                // the oldDaemon and make a new one from scratch.  The
-                // requeue is a stopgap measure anyway, so REVIEW.
-
-                // We can't overwrite the key in place, only the value.
-                // Because the key is a NodeRef to the old descriptor,
-                // we have to use the old Tree in order to keep
-                // that NodeRef good.  Requeuing "starts the Daemon from
-                // the top" which means the whole construction happens
-                // again, not just continue()ing or start()ing.  It all
-                // needs to be rethought, but basically all the Daemon
-                // state gets thrown away here and a new Daemon is
-                // created - that's excessive.
-
-                // http://www.cplusplus.com/forum/general/26950/
-                itPair->second = createPresent(*(oldDaemon._descriptor));
-            } else {
-                // a request for this descriptor already serviced; ignore.
-            }
-        }
+optional<ThinkerPresentBase> DaemonManager::tryGetStaleDaemonPresent (
+    methyl::Tree<Descriptor> const & descriptor,
+    std::type_info const & info,
+    quint64 & generation
+) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    size_t descriptorHash = std::hash<Tree<Descriptor>>()(descriptor);
+
+    // Stale results hold on to their interned descriptor, so if it isn't
+    // in the table there aren't any.
+
+    auto interned = _descriptors.tryFind(descriptor, descriptorHash);
+    if (not interned)
+        return nullopt;
+
+    return tryGetStaleInternedPresent(interned, info, generation);
+}
+
+
+optional<ThinkerPresentBase> DaemonManager::tryGetStaleInternedPresent (
+    shared_ptr<InternedDescriptor const> const & descriptor,
+    std::type_info const & info,
+    quint64 & generation
+) {
+    hopefully(not isDaemonManagerThreadCurrent(), HERE);
+
+    DaemonMapShard & shard = getShard(descriptor->hash());
+
+    QReadLocker lock (&shard.lock);
+
+    auto itType = shard.stale.find(&info);
+    if (itType == shard.stale.end())
+        return nullopt;
+
+    auto it = itType->second.find(descriptor);
+    if (it == itType->second.end())
+        return nullopt;
+
+    generation = it->second.generation;
+    return it->second.present;
+}
+
+
+void DaemonManager::noteDaemonRequested (
+    ThinkerPresentBase & present,
+    DaemonBase * requester,
+    DaemonPriority priority
+) {
+    DaemonBase & daemon = getDaemon(present);
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 now = timer.msecsSinceReference();
+
+    qint64 last = daemon._lastRequestTick.load(std::memory_order_relaxed);
+    if (now - last > DaemonBase::msecRequestTickSlack)
+        daemon._lastRequestTick.store(now, std::memory_order_relaxed);
+
+    // A Daemon asking for another one's results keeps them from being
+    // garbage collected while it is unfinished.
+
+    if (requester != nullptr) {
+        QMutexLocker lock (&daemon._dependentsMutex);
+        daemon._dependents.insert(requester->_key);
     }
+
+    // Partial results may not be enough for the requester, and if they
+    // aren't it will need waking when there's more.
+
+    if ((requester != nullptr) and not daemon._isComplete)
+        requester->_awaiting.insert(daemon._key);
+
+    if (raisePriority(daemon, priority))
+        emit priorityRaised(daemon._serial);
 }
 
 
-void DaemonManager::onEnsureDaemonsPausedBlocking (codeplace cp) {
-    DAEMONMANAGER
+DaemonPriority DaemonManager::inferPriority (DaemonBase const * requester) {
+    if (requester != nullptr)
+        return static_cast<DaemonPriority>(requester->_priority.load());
 
-    ThinkerManager::ensureThinkersPaused(cp);
+    // Not a Daemon, and not the Daemon Manager...so someone on the worker
+    // or GUI, who is presumably trying to show something.
+
+    return DaemonPriority::Interactive;
 }
 
 
-void DaemonManager::onEnsureDaemonsResumedBlocking (codeplace cp) {
+bool DaemonManager::raisePriority (
+    DaemonBase & daemon,
+    DaemonPriority priority
+) {
+    int desired = static_cast<int>(priority);
+    int current = daemon._priority;
+
+    while (current < desired) {
+        if (daemon._priority.compare_exchange_weak(current, desired))
+            return true;
+    }
+    return false;
+}
+
+
+void DaemonManager::onPriorityRaised (quint64 serial) {
     DAEMONMANAGER
 
-    // Look for any daemons that are now invalid; they have to be
-    // destroyed
-    for (auto & typeinfoAndMap : _daemonMap) {
+    auto itLive = _liveDaemons.find(serial);
+    if (itLive == _liveDaemons.end())
+        return;
 
-        auto & nodeToDaemonPresentMap = typeinfoAndMap.second;
+    // Walk down through what it declared as prerequisites and what it is
+    // parked waiting on, bringing them up to the same priority.  (Anything
+    // already at least that high has had its own dependencies raised.)
 
-        auto it = begin(nodeToDaemonPresentMap);
+    std::vector<quint64> pending {serial};
 
-        while (it != end(nodeToDaemonPresentMap)) {
-            ThinkerPresentBase & daemonPresent = it->second;
+    while (not pending.empty()) {
+        quint64 current = pending.back();
+        pending.pop_back();
 
-            DaemonBase & daemon = dynamic_cast<DaemonBase &>(
-                getThinkerBase(daemonPresent)
-            );
+        auto itCurrent = _liveDaemons.find(current);
+        if (itCurrent == _liveDaemons.end())
+            continue;
 
-            if (daemon._observer->isBlinded()) {
-                auto itErase (it);
-                it++;
+        DaemonBase & daemon = getDaemon(itCurrent->second);
+        auto priority = static_cast<DaemonPriority>(daemon._priority.load());
 
-                daemonPresent.cancel();
+        // No longer Speculative means it shouldn't be held up any more by
+        // the Interactive ones.  (Unless a pause window has it, in which
+        // case the window's end resumes it.)
 
-                // free the daemon, the observer upon which it
-                // calculated are no longer correct; it will be
-                // recreated again if it is needed.
-                nodeToDaemonPresentMap.erase(itErase);
-            } else {
-                it++;
+        if (
+            (priority != DaemonPriority::Speculative)
+            and (_priorityPaused.erase(current) != 0)
+            and not _isFullPause
+            and not (
+                _isSelectivePause and (_selectivelyPaused.count(current) != 0)
+            )
+        ) {
+            itCurrent->second.resume();
+        }
+
+        trackPriority(daemon);
+
+        std::vector<DaemonKey> keys = daemon._prerequisiteKeys;
+
+        auto itParked = _parked.find(current);
+        if (itParked != _parked.end()) {
+            auto & awaited = itParked->second;
+            keys.insert(end(keys), begin(awaited), end(awaited));
+        }
+
+        for (DaemonKey const & key : keys) {
+            auto range = _liveKeys.equal_range(key);
+            for (auto it = range.first; it != range.second; it++) {
+                auto itDependency = _liveDaemons.find(it->second);
+                if (itDependency == _liveDaemons.end())
+                    continue;
+
+                if (raisePriority(getDaemon(itDependency->second), priority))
+                    pending.push_back(it->second);
             }
         }
     }
 
-    ThinkerManager::ensureThinkersResumed(HERE);
+    rebalancePriorities();
 }
 
 
-void DaemonManager::ensureAllDaemonsPaused (codeplace const & cp) {
-    WORKER
+void DaemonManager::trackPriority (DaemonBase & daemon) {
+    DAEMONMANAGER
 
-    emit ensureDaemonsPausedBlocking(cp);
-}
+    quint64 serial = daemon._serial;
 
+    _interactiveRunnable.erase(serial);
+    _speculativeRunnable.erase(serial);
 
-void DaemonManager::ensureValidDaemonsResumed (codeplace const & cp) {
-    WORKER
+    if (
+        daemon._isComplete
+        or (_parkPaused.count(serial) != 0)
+        or (_priorityPaused.count(serial) != 0)
+    ) {
+        return;
+    }
 
-    emit ensureDaemonsResumedBlocking(cp);
+    switch (static_cast<DaemonPriority>(daemon._priority.load())) {
+    case DaemonPriority::Interactive:
+        _interactiveRunnable.insert(serial);
+        break;
+    case DaemonPriority::Speculative:
+        _speculativeRunnable.insert(serial);
+        break;
+    case DaemonPriority::Background:
+        break;
+    }
 }
 
 
-DaemonManager::~DaemonManager () {
-    // Can't use DAEMONMANAGER here because globalWorker, which holds onto
-    // the pointer for the thread, has been nulled during the destructor
-    // to avoid partial usages.
+void DaemonManager::rebalancePriorities () {
+    DAEMONMANAGER
 
-    hopefully(QThread::currentThread() == thread(), HERE);
+    // Pause windows pause and resume things themselves; we'll be called
+    // again at the end of them.
 
-    // ThinkerManager and ThinkerPresents demand destruction on the
-    // thread they were started on.  As a Thinker::Present is a shared
-    // pointer under the hood this does not guarantee they will all be
-    // destructed before the thinkerManager is reset, but from the
-    // engine's point of view those are the only handles we have.
+    if (_isFullPause or _isSelectivePause)
+        return;
 
-    ThinkerManager::ensureThinkersPaused(HERE);
-    _daemonMap.clear();
+    if (_interactiveRunnable.empty()) {
+        for (auto & serialAndTick : _priorityPaused) {
+            auto itLive = _liveDaemons.find(serialAndTick.first);
+            if (itLive == _liveDaemons.end())
+                continue;
+
+            itLive->second.resume();
+            _speculativeRunnable.insert(serialAndTick.first);
+        }
+        _priorityPaused.clear();
+        _agedUntil.clear();
+        return;
+    }
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 now = timer.msecsSinceReference();
+
+    // Those that have waited long enough get their slice.
+
+    auto itPaused = begin(_priorityPaused);
+    while (itPaused != end(_priorityPaused)) {
+        if (now - itPaused->second < msecMaxPriorityPause) {
+            itPaused++;
+            continue;
+        }
+
+        quint64 serial = itPaused->first;
+        itPaused = _priorityPaused.erase(itPaused);
+
+        auto itLive = _liveDaemons.find(serial);
+        if (itLive == _liveDaemons.end())
+            continue;
+
+        itLive->second.resume();
+        _agedUntil[serial] = now + msecAgedSlice;
+        _speculativeRunnable.insert(serial);
+    }
+
+    // One that finished on its own thread but hasn't been heard about yet
+    // is left be; onDaemonCompleted() takes it out of the running.
+
+    auto it = begin(_speculativeRunnable);
+    while (it != end(_speculativeRunnable)) {
+        ThinkerPresentBase & present = _liveDaemons.at(*it);
+
+        if (getDaemon(present)._isComplete) {
+            it++;
+            continue;
+        }
+
+        auto itAged = _agedUntil.find(*it);
+        if (itAged != _agedUntil.end()) {
+            if (itAged->second > now) {
+                it++;
+                continue;
+            }
+            _agedUntil.erase(itAged);
+        }
+
+        present.pause();
+        _priorityPaused[*it] = now;
+        it = _speculativeRunnable.erase(it);
+    }
+}
+
+
+DaemonBase * DaemonManager::tryGetRequestingDaemon () {
+    if (not isDaemonThreadCurrent())
+        return nullptr;
+
+    ThinkerBase const * thinker
+        = getThinkerForThreadMaybeNull(*QThread::currentThread());
+
+    if (thinker == nullptr)
+        return nullptr;
+
+    return const_cast<DaemonBase *>(
+        &dynamic_cast<DaemonBase const &>(*thinker)
+    );
+}
+
+
+bool DaemonManager::isAwaited (DaemonKey const & key) const {
+    DAEMONMANAGER
+
+    return (_awaitingCompletion.count(key) != 0)
+        or (_parkedOn.count(key) != 0);
+}
+
+
+auto DaemonManager::tryTakeNextPending () -> optional<PendingCreation> {
+    DAEMONMANAGER
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 now = timer.msecsSinceReference();
+
+    // Descriptors being dropped are freed after the lock is let go.
+
+    std::vector<PendingCreation> stale;
+    optional<PendingCreation> result;
+
+    {
+        QMutexLocker lock (&_pendingMutex);
+
+        // Oldest first, so this stops at the first one that is recent.  One
+        // that someone is waiting on is kept, by counting it as asked for
+        // again just now.
+
+        while (not _pendingByAge.empty()) {
+            PendingOrder oldest = *begin(_pendingByAge);
+            if (now - oldest.requestTick <= msecPendingTimeout)
+                break;
+
+            PendingCreation pending = erasePending(_pending.find(oldest));
+
+            if (isAwaited(DaemonKey {pending.info, pending.descriptorHash})) {
+                pending.requestTick = now;
+                insertPending(std::move(pending));
+                continue;
+            }
+
+            stale.push_back(std::move(pending));
+        }
+
+        if (not _pending.empty())
+            result = erasePending(begin(_pending));
+    }
+
+    return result;
+}
+
+
+void DaemonManager::wakeIfPending () {
+    QMutexLocker lock (&_pendingMutex);
+
+    signalPendingCreations();
+}
+
+
+void DaemonManager::onPendingCreations () {
+    DAEMONMANAGER
+
+    {
+        QMutexLocker lock (&_pendingMutex);
+        _isWakePending = false;
+    }
+
+    // Daemons that weren't paused are running during a selective pause,
+    // but a new one can't be started: we have no idea yet what it will
+    // observe.  Nor can one be made during any pause, as creating it means
+    // reading the document while the worker may be writing to it.  The
+    // end of the window wakes us up again.
+
+    if (_isSelectivePause or _isFullPause)
+        return;
+
+    for (int count = 0; count < maxCreationsPerWake; count++) {
+        optional<PendingCreation> pending = tryTakeNextPending();
+        if (not pending)
+            break;
+        createDaemon(std::move(*pending));
+    }
+
+    // Rather than loop until done, go back through the event queue so that
+    // anything else waiting on this thread gets a turn.
+
+    wakeIfPending();
+
+    rebalancePriorities();
+}
+
+
+void DaemonManager::createDaemon (PendingCreation && pending) {
+    DAEMONMANAGER
+
+    std::type_info const * info = pending.info;
+    DaemonFactory factory = pending.factory;
+    qint64 requestTick = pending.requestTick;
+    DaemonPriority priority = pending.priority;
+
+    optional<Tree<Descriptor>> newDescriptor
+        = methyl::globalEngine->reconstituteTree<Descriptor>(
+            pending.descriptorOwned.release(), pending.context
+        );
+
+    hopefully(newDescriptor != nullopt, HERE);
+
+    size_t descriptorHash = pending.descriptorHash;
+
+    auto createPresent = [&](
+        shared_ptr<InternedDescriptor const> const & interned
+    )
+        -> ThinkerPresentBase
+    {
+        Node<Descriptor const> descriptor = interned->root();
+
+        QElapsedTimer timer;
+        timer.start();
+
+        // This is tricky, because we are being asked to tell the observer
+        // all the roots of trees we want to watch and become invalid if
+        // they are modified.  Technically speaking we'd care if the
+        // descriptor were to change, but it isn't allowed to so we
+        // don't have to mention it.  A Daemon is free to create and
+        // manipulate new nodes, and we wouldn't want creating a node and
+        // observing it then destroying it to count as an invalidation
+        // (the Daemon knew what it was doing, presumably...and this is
+        // not an invalidation of the input to the process...it's no
+        // different than using any other temporary variables)
+        //
+        // So we consider the root of the document (and in the future
+        // this would be the root of all user documents; and basically any
+        // other state which might be considered a relevant input)...unless
+        // the Daemon class says it only reads some subtree of it, in which
+        // case changes outside of that subtree aren't its concern.
+
+        auto & app = getApplication<ApplicationBase>();
+        auto & worker = app.getWorker();
+
+        // The descriptor was created with a different observation context
+        // than we want the Daemon's observations to be using.  So all the
+        // observations need to be made through a new monitoring facility
+        // based on the observer in this Daemon.
+
+        auto context = make_shared<Context>(HERE);
+        descriptor = methyl::globalEngine->contextualNodeRef(
+            descriptor, context
+        );
+
+        // There's no observer to hook up yet, as this is what says where
+        // it goes; so it's on the Daemon class not to read the document
+        // here.  (See Daemon<T>::observationRootFor.)
+
+        optional<Node<methyl::Accessor const>> scope
+            = factory.observationRootFor(descriptor);
+
+        Node<methyl::Accessor const> observedRoot
+            = scope ? *scope : app.getDocument();
+
+        auto observer = methyl::Observer::create(observedRoot, HERE);
+
+        {
+            // To keep from blocking the worker, we call the Daemon
+            // constructor from the DaemonManagerThread.  We need to
+            // make sure that Methyl knows to log observations of
+            // data to the observer we're going to put into the Daemon
+            // after creation.
+
+            QWriteLocker lock (&worker._observersLock);
+            worker._threadsToObservers[QThread::currentThread()] = observer;
+        }
+
+        unique_ptr<ThinkerBase> thinker = factory.create(descriptor);
+
+        // Asked while the observer is still hooked up, in case working
+        // out the prerequisites involves looking at the document.
+
+        std::vector<DaemonRequest> prerequisites
+            = dynamic_cast<DaemonBase &>(*thinker).getPrerequisites();
+
+        {
+            // Further running of the Daemon will be from the thread
+            // pool, so remove the association of node observations
+            // from the DaemonManager thread.
+
+            QWriteLocker lock (&worker._observersLock);
+            worker._threadsToObservers.remove(QThread::currentThread());
+        }
+
+        DaemonBase & daemon = dynamic_cast<DaemonBase &>(*thinker);
+
+        // Set the internal properties.  These "belong" to the manager,
+        // but it's more efficient to poke them into the Daemon itself
+        // to avoid the hash table storage and lookup.
+
+        daemon._descriptor = descriptor;
+        daemon._context = context;
+        daemon._lastRequestTick = requestTick;
+        daemon._msecsUsed = timer.elapsed();
+        daemon._key = DaemonKey {info, descriptorHash};
+        daemon._serial = _nextSerial++;
+        daemon._priority = static_cast<int>(priority);
+        daemon._observer = observer;
+        daemon._observedRoots.push_back(observedRoot);
+        daemon._generation = app.getDocumentGeneration();
+        daemon._interned = interned;
+
+        if (daemon.isPersistent())
+            trySeedFromCache(daemon, factory);
+
+        if (daemon.isIncremental() and daemon._cacheSeed.isEmpty())
+            tryTakeRetired(daemon);
+
+        // A Daemon loading its results from the cache won't be running
+        // startDaemon(), so it doesn't need anything computed for it.
+
+        if (daemon._cacheSeed.isEmpty())
+            queuePrerequisites(daemon, std::move(prerequisites));
+
+        DaemonKey key = daemon._key;
+        quint64 serial = daemon._serial;
+
+        ThinkerPresentBase present = runBase(std::move(thinker), HERE);
+
+        _liveDaemons.insert(std::make_pair(serial, present));
+        _liveKeys.insert(std::make_pair(key, serial));
+        indexObservedRoots(getDaemon(present));
+
+        trackPriority(getDaemon(present));
+
+        return present;
+    };
+
+    DaemonMapShard & shard = getShard(descriptorHash);
+
+    // If some other kind of Daemon already has this descriptor, then the
+    // one we were handed is dropped and we share theirs.
+
+    shared_ptr<InternedDescriptor const> interned
+        = _descriptors.intern(std::move(*newDescriptor), descriptorHash);
+
+    // The pending set keeps out duplicates while a request is waiting, but
+    // someone who missed in the map just before the Daemon went in could
+    // add the same descriptor again right after it was taken out.  Only
+    // this thread changes the map, so it can look without the lock.
+
+    auto itType = shard.types.find(info);
+    if (itType != shard.types.end()) {
+        auto itPair = itType->second.find(interned);
+        if (itPair != itType->second.end()) {
+            // A request for this descriptor already serviced.  It might
+            // have been asked for more urgently this time, though.
+
+            DaemonBase & daemon = getDaemon(itPair->second);
+            if (raisePriority(daemon, priority))
+                emit priorityRaised(daemon._serial);
+            return;
+        }
+    }
+
+    // Construction runs client code, and seeding from the cache digests
+    // the observed subtrees and reads a file.  None of that needs the
+    // shard, so readers of it are only held up for the insert itself.
+
+    ThinkerPresentBase present = createPresent(interned);
+
+    {
+        QWriteLocker lock (&shard.lock);
+
+        shard.types[info].insert(std::make_pair(interned, present));
+    }
+
+    // It will be in the map by the time anyone woken can get the lock.
+
+    notifySettled();
+}
+
+
+bool DaemonManager::isKeyComplete (DaemonKey const & key) const {
+    DAEMONMANAGER
+
+    // One that is paused for a write may not survive it, and whoever is
+    // waiting will be woken at the end of the window if it does.
+
+    auto range = _liveKeys.equal_range(key);
+    for (auto it = range.first; it != range.second; it++) {
+        if (
+            _isSelectivePause
+            and (_selectivelyPaused.count(it->second) != 0)
+        ) {
+            continue;
+        }
+
+        if (getDaemon(_liveDaemons.at(it->second))._isComplete)
+            return true;
+    }
+
+    return false;
+}
+
+
+void DaemonManager::wakeDaemonsAwaiting (DaemonKey const & key) {
+    DAEMONMANAGER
+
+    auto itOn = _parkedOn.find(key);
+    if (itOn == _parkedOn.end())
+        return;
+
+    std::unordered_set<quint64> serials;
+    serials.swap(itOn->second);
+    _parkedOn.erase(itOn);
+
+    for (quint64 serial : serials) {
+        auto it = _parked.find(serial);
+        it->second.erase(key);
+
+        if (not it->second.empty())
+            continue;
+
+        _parked.erase(it);
+
+        auto itLive = _liveDaemons.find(serial);
+        if (itLive != _liveDaemons.end())
+            tryUnpark(itLive->second);
+    }
+}
+
+
+void DaemonManager::setParked (
+    quint64 serial,
+    std::unordered_set<DaemonKey> && keys
+) {
+    DAEMONMANAGER
+
+    forgetParked(serial);
+
+    for (DaemonKey const & key : keys)
+        _parkedOn[key].insert(serial);
+
+    _parked[serial] = std::move(keys);
+}
+
+
+void DaemonManager::forgetParked (quint64 serial) {
+    DAEMONMANAGER
+
+    auto it = _parked.find(serial);
+    if (it == _parked.end())
+        return;
+
+    for (DaemonKey const & key : it->second) {
+        auto itOn = _parkedOn.find(key);
+        itOn->second.erase(serial);
+        if (itOn->second.empty())
+            _parkedOn.erase(itOn);
+    }
+
+    _parked.erase(it);
+}
+
+
+void DaemonManager::tryUnpark (ThinkerPresentBase & present) {
+    DAEMONMANAGER
+
+    DaemonBase & daemon = getDaemon(present);
+
+    if (_isFullPause)
+        return;
+
+    if (_isSelectivePause and (_selectivelyPaused.count(daemon._serial) != 0))
+        return;
+
+    if (_parkPaused.erase(daemon._serial) != 0) {
+        present.resume();
+        trackPriority(daemon);
+    }
+}
+
+
+void DaemonManager::queuePrerequisites (
+    DaemonBase & daemon,
+    std::vector<DaemonRequest> && prerequisites
+) {
+    DAEMONMANAGER
+
+    // Only the DaemonManager changes the map, so it can look in any shard
+    // without taking that shard's lock.
+
+    QElapsedTimer timer;
+    timer.start();
+
+    auto priority = static_cast<DaemonPriority>(daemon._priority.load());
+
+    for (DaemonRequest & request : prerequisites) {
+        DaemonKey key {
+            request.info,
+            std::hash<Tree<Descriptor>>()(request.descriptor)
+        };
+
+        daemon._prerequisiteKeys.push_back(key);
+
+        optional<ThinkerPresentBase> present;
+
+        auto interned = _descriptors.tryFind(
+            request.descriptor, key.descriptorHash
+        );
+        DaemonMapShard & shard = getShard(key.descriptorHash);
+
+        auto itType = shard.types.find(request.info);
+        if (interned and (itType != shard.types.end())) {
+            auto it = itType->second.find(interned);
+            if (it != itType->second.end())
+                present = it->second;
+        }
+
+        if (present) {
+            DaemonBase & prerequisite = getDaemon(*present);
+
+            {
+                QMutexLocker lock (&prerequisite._dependentsMutex);
+                prerequisite._dependents.insert(daemon._key);
+            }
+
+            if (raisePriority(prerequisite, priority))
+                emit priorityRaised(prerequisite._serial);
+
+            if (prerequisite._isComplete)
+                continue;
+        } else {
+            queueDaemonCreation(
+                std::move(request.descriptor),
+                key.descriptorHash,
+                request.factory,
+                *request.info,
+                timer.msecsSinceReference(),
+                priority
+            );
+        }
+
+        _awaitingCompletion[key].push_back(daemon._serial);
+        daemon._prerequisitesPending++;
+    }
+}
+
+
+void DaemonManager::releaseAwaitingCompletion (DaemonKey const & key) {
+    DAEMONMANAGER
+
+    auto it = _awaitingCompletion.find(key);
+    if (it == _awaitingCompletion.end())
+        return;
+
+    std::vector<quint64> serials;
+    serials.swap(it->second);
+    _awaitingCompletion.erase(it);
+
+    for (quint64 serial : serials) {
+        auto itLive = _liveDaemons.find(serial);
+        if (itLive == _liveDaemons.end())
+            continue;
+
+        DaemonBase & waiter = getDaemon(itLive->second);
+        if (--waiter._prerequisitesPending == 0)
+            tryUnpark(itLive->second);
+    }
+}
+
+
+void DaemonManager::onDaemonCompleted (quint64 serial) {
+    DAEMONMANAGER
+
+    auto itLive = _liveDaemons.find(serial);
+    if (itLive == _liveDaemons.end())
+        return;
+
+    DaemonBase & daemon = getDaemon(itLive->second);
+
+    // If it was updated from retired results, they aren't needed now.  It
+    // isn't running any more, so they can be dropped from here.
+
+    daemon._previous = nullopt;
+    daemon._changedRoots.clear();
+
+    dropStale(daemon);
+
+    releaseAwaitingCompletion(daemon._key);
+
+    wakeDaemonsAwaiting(daemon._key);
+
+    trackPriority(daemon);
+
+    rebalancePriorities();
+}
+
+
+void DaemonManager::onDaemonParked (
+    quint64 serial,
+    std::vector<DaemonKey> awaiting
+) {
+    DAEMONMANAGER
+
+    // If it was discarded since it sent this, it was cancelled...which ends
+    // its wait for a pause request.
+
+    auto itLive = _liveDaemons.find(serial);
+    if (itLive == _liveDaemons.end())
+        return;
+
+    ThinkerPresentBase present = itLive->second;
+    DaemonBase & daemon = getDaemon(present);
+
+    // It may have been resumed by a pause window since, and be running
+    // again.  If a pause window is still going, it has already been asked
+    // to pause, and will be resumed when the window ends.
+
+    if (not daemon._isParked)
+        return;
+
+    if (
+        _isFullPause
+        or (_isSelectivePause and (_selectivelyPaused.count(serial) != 0))
+    ) {
+        return;
+    }
+
+    // Making way for an Interactive Daemon may have paused it already, in
+    // which case it's now paused for parking instead.  (A second message
+    // for the same park, after a window resumed it, finds it paused too.)
+
+    if (
+        (_priorityPaused.erase(serial) == 0)
+        and (_parkPaused.count(serial) == 0)
+    ) {
+        present.pause();
+    }
+    _parkPaused.insert(serial);
+    trackPriority(daemon);
+
+    // What it was turned away by may have been discarded (say by a write
+    // in a selective window) between the snapshot and this message.  The
+    // wake for that has already gone by, and with no Daemon for the key
+    // and none pending there won't be another.  So rather than wait on it,
+    // let it run again; snapshotting asks for the Daemon to be made anew.
+
+    std::unordered_set<DaemonKey> stillAwaiting;
+    bool isAnyOrphaned = false;
+    {
+        QMutexLocker lock (&_pendingMutex);
+
+        for (DaemonKey const & key : awaiting) {
+            if (isKeyComplete(key))
+                continue;
+
+            if (
+                (_liveKeys.count(key) == 0)
+                and (_pendingKeys.count(key) == 0)
+            ) {
+                isAnyOrphaned = true;
+            }
+
+            stillAwaiting.insert(key);
+        }
+    }
+
+    if (isAnyOrphaned)
+        stillAwaiting.clear();
+
+    // Waiting on prerequisites comes with no keys, and it's the count that
+    // says when it's done; releaseAwaitingCompletion() unparks it then.
+
+    if (stillAwaiting.empty()) {
+        forgetParked(serial);
+        if (daemon._prerequisitesPending == 0)
+            tryUnpark(present);
+        return;
+    }
+
+    setParked(serial, std::move(stillAwaiting));
+}
+
+
+void DaemonManager::onEnsureDaemonsPausedBlocking (codeplace cp) {
+    DAEMONMANAGER
+
+    _isFullPause = true;
+
+    // Without a write set, any node of the document may be freed.
+
+    _retired.clear();
+
+    ThinkerManager::ensureThinkersPaused(cp);
+}
+
+
+bool DaemonManager::isSameOrAncestorOf (
+    Node<methyl::Accessor const> ancestor,
+    Node<methyl::Accessor const> node
+) {
+    while (true) {
+        if (node == ancestor)
+            return true;
+        if (not node->hasParent())
+            return false;
+        node = node->getParent();
+    }
+}
+
+
+bool DaemonManager::isBeneathWriteRoot (
+    Node<methyl::Accessor const> node,
+    WriteSet const & writeSet
+) {
+    for (Node<methyl::Accessor const> writeRoot : writeSet) {
+        if ((writeRoot != node) and isSameOrAncestorOf(writeRoot, node))
+            return true;
+    }
+    return false;
+}
+
+
+void DaemonManager::indexObservedRoots (DaemonBase const & daemon) {
+    DAEMONMANAGER
+
+    auto & ancestors = _indexedAncestors[daemon._serial];
+
+    for (auto & observedRoot : daemon._observedRoots) {
+        _observersAt[observedRoot].insert(daemon._serial);
+
+        auto node = observedRoot;
+        while (true) {
+            _observersBeneath[node].insert(daemon._serial);
+            ancestors.push_back(node);
+
+            if (not node->hasParent())
+                break;
+            node = node->getParent();
+        }
+    }
+}
+
+
+void DaemonManager::unindexObservedRoots (DaemonBase const & daemon) {
+    DAEMONMANAGER
+
+    auto unindex = [&](ObserverIndex & index, Node<methyl::Accessor const> n) {
+        auto it = index.find(n);
+        if (it == index.end())
+            return;
+
+        it->second.erase(daemon._serial);
+        if (it->second.empty())
+            index.erase(it);
+    };
+
+    for (auto & observedRoot : daemon._observedRoots)
+        unindex(_observersAt, observedRoot);
+
+    auto itAncestors = _indexedAncestors.find(daemon._serial);
+    if (itAncestors == _indexedAncestors.end())
+        return;
+
+    for (auto & node : itAncestors->second)
+        unindex(_observersBeneath, node);
+
+    _indexedAncestors.erase(itAncestors);
+}
+
+
+std::unordered_set<quint64> DaemonManager::findAffected (
+    WriteSet const & writeSet
+) {
+    DAEMONMANAGER
+
+    // A write beneath an observed root may change what was observed, and
+    // a write above one may replace the observed root entirely.  Only
+    // subtrees which are disjoint are safe.
+
+    std::unordered_set<quint64> result;
+
+    auto gather = [&](ObserverIndex & index, Node<methyl::Accessor const> n) {
+        auto it = index.find(n);
+        if (it != index.end())
+            result.insert(begin(it->second), end(it->second));
+    };
+
+    for (Node<methyl::Accessor const> writeRoot : writeSet) {
+        gather(_observersBeneath, writeRoot);
+
+        auto node = writeRoot;
+        while (true) {
+            gather(_observersAt, node);
+
+            if (not node->hasParent())
+                break;
+            node = node->getParent();
+        }
+    }
+
+    return result;
+}
+
+
+bool DaemonManager::isDetached (DaemonBase const & daemon) {
+    if (_rootsMayBeFreed.count(daemon._serial) != 0)
+        return true;
+
+    auto document = getApplication<ApplicationBase>().getDocument();
+
+    for (auto & observedRoot : daemon._observedRoots) {
+        if (not isSameOrAncestorOf(document, observedRoot))
+            return true;
+    }
+    return false;
+}
+
+
+auto DaemonManager::locateDaemon (DaemonBase const & daemon)
+    -> std::pair<DescriptorMap *, DescriptorMap::iterator>
+{
+    DAEMONMANAGER
+
+    DaemonMapShard & shard = getShard(daemon._key.descriptorHash);
+
+    auto itType = shard.types.find(daemon._key.info);
+    hopefully(itType != shard.types.end(), HERE);
+
+    auto it = itType->second.find(daemon._interned);
+    hopefully(it != itType->second.end(), HERE);
+
+    return std::make_pair(&itType->second, it);
+}
+
+
+void DaemonManager::onEnsureAffectedDaemonsPausedBlocking (
+    WriteSet writeSet,
+    codeplace cp
+) {
+    DAEMONMANAGER
+
+    Q_UNUSED(cp);
+
+    hopefully(not _isSelectivePause, HERE);
+    hopefully(_selectivelyPaused.empty(), HERE);
+
+    _isSelectivePause = true;
+    _selectiveWriteSet = writeSet;
+
+    dropRetiredBeneath(writeSet);
+
+    for (quint64 serial : findAffected(writeSet)) {
+        auto itLive = _liveDaemons.find(serial);
+        if (itLive == _liveDaemons.end())
+            continue;
+
+        DaemonBase & daemon = getDaemon(itLive->second);
+        for (auto & observedRoot : daemon._observedRoots) {
+            if (isBeneathWriteRoot(observedRoot, writeSet))
+                _rootsMayBeFreed.insert(serial);
+        }
+
+        itLive->second.pause();
+        _selectivelyPaused.insert(serial);
+    }
+}
+
+
+void DaemonManager::onEnsureDaemonsResumedBlocking (codeplace cp) {
+    DAEMONMANAGER
+
+    // Whatever survives the check below is valid for the document as it
+    // is now, so it is carried forward to the current generation.
+
+    quint64 generation
+        = getApplication<ApplicationBase>().getDocumentGeneration();
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 now = timer.msecsSinceReference();
+
+    if (_isSelectivePause) {
+        // Only the daemons we paused can have been affected; the others
+        // were judged to be watching disjoint subtrees and kept running.
+        // Those may be snapshotting each other right now, so erasing has
+        // to be done under the lock.
+
+        AllShardsWriteLocker lock (*this);
+
+        updateRetired(&_selectiveWriteSet);
+
+        std::vector<DaemonKey> completed;
+
+        for (quint64 serial : _selectivelyPaused) {
+            auto itLive = _liveDaemons.find(serial);
+            if (itLive == _liveDaemons.end())
+                continue;
+
+            ThinkerPresentBase present = itLive->second;
+            DaemonBase & daemon = getDaemon(present);
+
+            if (
+                daemon._observer->isBlinded()
+                or daemon._isSeeded
+                or isDetached(daemon)
+            ) {
+                retireDaemon(daemon, present, &_selectiveWriteSet);
+                keepStale(daemon, present, now);
+
+                auto location = locateDaemon(daemon);
+                discardDaemon(*location.first, location.second);
+                continue;
+            }
+
+            // The write may have moved it around, so its ancestors are
+            // worked out again.
+
+            unindexObservedRoots(daemon);
+            indexObservedRoots(daemon);
+
+            present.resume();
+            _priorityPaused.erase(serial);
+            _parkPaused.erase(serial);
+            forgetParked(serial);
+            trackPriority(daemon);
+
+            if (daemon._isComplete)
+                completed.push_back(daemon._key);
+        }
+
+        _resumedGeneration = generation;
+
+        _selectivelyPaused.clear();
+        _selectiveWriteSet.clear();
+        _rootsMayBeFreed.clear();
+        _isSelectivePause = false;
+
+        lock.unlock();
+
+        // Those waiting on what came through the write unscathed weren't
+        // woken while it was paused; see isKeyComplete().
+
+        for (DaemonKey const & key : completed)
+            wakeDaemonsAwaiting(key);
+
+        wakeIfPending();
+
+        rebalancePriorities();
+        return;
+    }
+
+    // Not knowing what was written, there's nothing for it but to look
+    // at every Daemon for ones that are now invalid; they have to be
+    // destroyed.  Paused Daemons can't be snapshotting, but the GUI can,
+    // so this is locked like any other change to the map.  The index is
+    // built again from scratch for the ones left over, as anything could
+    // have moved.
+
+    AllShardsWriteLocker lock (*this);
+
+    for (auto & shard : _daemonMapShards) {
+        for (auto & typeinfoAndMap : shard.types) {
+
+            auto & nodeToDaemonPresentMap = typeinfoAndMap.second;
+
+            auto it = begin(nodeToDaemonPresentMap);
+
+            while (it != end(nodeToDaemonPresentMap)) {
+                ThinkerPresentBase & daemonPresent = it->second;
+
+                DaemonBase & daemon = dynamic_cast<DaemonBase &>(
+                    getThinkerBase(daemonPresent)
+                );
+
+                if (
+                    daemon._observer->isBlinded()
+                    or daemon._isSeeded
+                    or isDetached(daemon)
+                ) {
+                    // free the daemon, the observer upon which it
+                    // calculated are no longer correct; it will be
+                    // recreated again if it is needed.  (A seeded one has
+                    // no observations to go by, so it goes too.  Nor does
+                    // an observer of a subtree that was cut out notice.)
+                    retireDaemon(daemon, daemonPresent, nullptr);
+                    keepStale(daemon, daemonPresent, now);
+                    it = discardDaemon(nodeToDaemonPresentMap, it);
+                } else {
+                    it++;
+                }
+            }
+        }
+    }
+
+    _observersAt.clear();
+    _observersBeneath.clear();
+    _indexedAncestors.clear();
+
+    for (auto & serialAndPresent : _liveDaemons)
+        indexObservedRoots(getDaemon(serialAndPresent.second));
+
+    _resumedGeneration = generation;
+
+    lock.unlock();
+
+    _isFullPause = false;
+
+    // Everything gets resumed, including what was paused to make way for
+    // interactive work...so sort that out again afterward.  Parked Daemons
+    // are resumed too, and will park again if they still can't proceed.
+
+    _priorityPaused.clear();
+    _parkPaused.clear();
+    _parked.clear();
+    _parkedOn.clear();
+
+    for (auto & serialAndPresent : _liveDaemons)
+        trackPriority(getDaemon(serialAndPresent.second));
+
+    ThinkerManager::ensureThinkersResumed(HERE);
+
+    wakeIfPending();
+
+    rebalancePriorities();
+}
+
+
+void DaemonManager::onEnsureDaemonsDiscardedBlocking (codeplace cp) {
+    DAEMONMANAGER
+
+    Q_UNUSED(cp);
+
+    AllShardsWriteLocker lock (*this);
+
+    // Nodes are being swapped rather than modified, so there's no saying
+    // what changed under anything that was retired.  Stale results go too,
+    // as they may refer to nodes that are about to be freed.
+
+    _retired.clear();
+
+    for (auto & shard : _daemonMapShards)
+        shard.stale.clear();
+
+    if (_isSelectivePause) {
+        for (quint64 serial : _selectivelyPaused) {
+            auto itLive = _liveDaemons.find(serial);
+            if (itLive == _liveDaemons.end())
+                continue;
+
+            auto location = locateDaemon(getDaemon(itLive->second));
+            discardDaemon(*location.first, location.second);
+        }
+
+        _selectivelyPaused.clear();
+        return;
+    }
+
+    for (auto & shard : _daemonMapShards) {
+        for (auto & typeinfoAndMap : shard.types) {
+
+            auto & nodeToDaemonPresentMap = typeinfoAndMap.second;
+
+            auto it = begin(nodeToDaemonPresentMap);
+
+            while (it != end(nodeToDaemonPresentMap))
+                it = discardDaemon(nodeToDaemonPresentMap, it);
+        }
+    }
+}
+
+
+void DaemonManager::noteChanges (
+    std::vector<Node<methyl::Accessor const>> const & observed,
+    WriteSet const * writeSet,
+    std::vector<Node<methyl::Accessor const>> & changed
+) {
+    auto document = getApplication<ApplicationBase>().getDocument();
+
+    // Roots that were cut out of the document are dropped, since the write
+    // that cut them out was above them and so is noted too.
+
+    changed.erase(
+        std::remove_if(
+            begin(changed),
+            end(changed),
+            [&](Node<methyl::Accessor const> const & existing) {
+                return not isSameOrAncestorOf(document, existing);
+            }
+        ),
+        end(changed)
+    );
+
+    // A change already covered by one noted above it isn't noted again,
+    // and noting one drops those it covers...so repeated edits in the same
+    // area don't make the list keep growing.
+
+    auto note = [&](Node<methyl::Accessor const> root) {
+        for (auto & existing : changed) {
+            if (isSameOrAncestorOf(existing, root))
+                return;
+        }
+
+        changed.erase(
+            std::remove_if(
+                begin(changed),
+                end(changed),
+                [&](Node<methyl::Accessor const> const & existing) {
+                    return isSameOrAncestorOf(root, existing);
+                }
+            ),
+            end(changed)
+        );
+        changed.push_back(root);
+    };
+
+    for (auto & observedRoot : observed) {
+        if (not writeSet) {
+            note(observedRoot);
+            continue;
+        }
+
+        for (Node<methyl::Accessor const> writeRoot : *writeSet) {
+            if (isSameOrAncestorOf(observedRoot, writeRoot))
+                note(writeRoot);
+            else if (isSameOrAncestorOf(writeRoot, observedRoot))
+                note(observedRoot);
+        }
+    }
+}
+
+
+void DaemonManager::retireDaemon (
+    DaemonBase const & daemon,
+    ThinkerPresentBase const & present,
+    WriteSet const * writeSet
+) {
+    DAEMONMANAGER
+
+    // A seeded Daemon's results may be fine, but it made no observations
+    // to say so.  One whose subtree was cut out has nothing to update.
+    // After a full pause there's no saying whether its roots are still
+    // there at all (see _retired).
+
+    if (
+        not writeSet
+        or not daemon.isIncremental()
+        or not daemon._isComplete
+        or daemon._isSeeded
+        or isDetached(daemon)
+    ) {
+        return;
+    }
+
+    RetiredDaemon retired {
+        daemon._key.info,
+        daemon._interned,
+        present,
+        daemon._observedRoots,
+        std::vector<Node<methyl::Accessor const>> ()
+    };
+    noteChanges(retired.observedRoots, writeSet, retired.changedRoots);
+
+    // An earlier retirement with the same key would be older results.
+
+    _retired.remove_if([&](RetiredDaemon const & other) {
+        return (other.interned == retired.interned)
+            and (*other.info == *retired.info);
+    });
+
+    _retired.push_back(std::move(retired));
+    if (_retired.size() > maxRetired)
+        _retired.pop_front();
+}
+
+
+void DaemonManager::dropRetiredBeneath (WriteSet const & writeSet) {
+    DAEMONMANAGER
+
+    _retired.remove_if([&](RetiredDaemon const & retired) {
+        for (auto & root : retired.observedRoots) {
+            if (isBeneathWriteRoot(root, writeSet))
+                return true;
+        }
+        for (auto & root : retired.changedRoots) {
+            if (isBeneathWriteRoot(root, writeSet))
+                return true;
+        }
+        return false;
+    });
+}
+
+
+void DaemonManager::updateRetired (WriteSet const * writeSet) {
+    DAEMONMANAGER
+
+    auto document = getApplication<ApplicationBase>().getDocument();
+
+    auto it = begin(_retired);
+    while (it != end(_retired)) {
+        bool detached = false;
+        for (auto & observedRoot : it->observedRoots) {
+            if (not isSameOrAncestorOf(document, observedRoot))
+                detached = true;
+        }
+
+        if (detached) {
+            it = _retired.erase(it);
+            continue;
+        }
+
+        noteChanges(it->observedRoots, writeSet, it->changedRoots);
+        it++;
+    }
+}
+
+
+void DaemonManager::tryTakeRetired (DaemonBase & daemon) {
+    DAEMONMANAGER
+
+    // In a pause window the changes being made now haven't been noted yet,
+    // so a Daemon created during one has to start over.
+
+    if (_isFullPause)
+        return;
+
+    for (auto it = begin(_retired); it != end(_retired); it++) {
+        if (
+            (it->interned != daemon._interned)
+            or (*it->info != *daemon._key.info)
+        ) {
+            continue;
+        }
+
+        // The same descriptor should mean the same roots are observed, but
+        // if they aren't then the old results weren't for the same input.
+
+        if (it->observedRoots == daemon._observedRoots) {
+            daemon._previous = it->present;
+            daemon._changedRoots = std::move(it->changedRoots);
+        }
+
+        _retired.erase(it);
+        return;
+    }
+}
+
+
+void DaemonManager::addSubtreeToDigest (
+    QCryptographicHash & digest,
+    Node<methyl::Accessor const> root
+) {
+    // Each node goes in as its tag, its text if it has any, and then for
+    // each tag it has children under, that tag and how many there are.
+    // The children follow in order, depth first.  With the counts ahead
+    // of what they count, no two different trees give the same bytes.
+    //
+    // Tags are identities that come from the source code, not from the
+    // run, so this is the same from one run to the next.  (If Methyl keeps
+    // a node's tags in the order they were added, the same content built
+    // in a different order would only miss the cache, not be mistaken.)
+
+    std::vector<Node<methyl::Accessor const>> stack;
+    stack.push_back(root);
+
+    while (not stack.empty()) {
+        Node<methyl::Accessor const> node = stack.back();
+        stack.pop_back();
+
+        QByteArray bytes;
+        QDataStream stream (&bytes, QIODevice::WriteOnly);
+
+        stream << node->getTag().toString();
+
+        stream << node->hasText();
+        if (node->hasText())
+            stream << node->getText();
+
+        std::vector<Node<methyl::Accessor const>> children;
+
+        if (node->hasAnyTags()) {
+            methyl::Tag tag = node->getFirstTag();
+            while (true) {
+                quint32 count = 0;
+                Node<methyl::Accessor const> child
+                    = node->getFirstChildInTag(tag);
+                while (true) {
+                    children.push_back(child);
+                    count++;
+                    if (not child->hasNextSiblingInTag())
+                        break;
+                    child = child->getNextSiblingInTag();
+                }
+
+                stream << true << tag.toString() << count;
+
+                if (not node->hasTagAfter(tag))
+                    break;
+                tag = node->getTagAfter(tag);
+            }
+        }
+
+        stream << false;
+
+        digest.addData(bytes);
+
+        stack.insert(end(stack), children.rbegin(), children.rend());
+    }
+}
+
+
+QByteArray DaemonManager::contentDigestOf (
+    std::vector<methyl::Node<methyl::Accessor const>> const & roots
+) {
+    DAEMONMANAGER
+
+    // Creation waits out pause windows, and the worker only writes to the
+    // document inside of one...moving the generation on before it ends.
+    // So the document can't be changing under us here, and whatever was
+    // digested at this generation is still what the document holds.
+
+    hopefully(not _isFullPause and not _isSelectivePause, HERE);
+
+    quint64 generation
+        = getApplication<ApplicationBase>().getDocumentGeneration();
+
+    if (generation != _contentDigestGeneration) {
+        _contentDigests.clear();
+        _contentDigestGeneration = generation;
+    }
+
+    QCryptographicHash result (QCryptographicHash::Sha1);
+
+    for (auto & root : roots) {
+        // The map is keyed on node identity, but the digest is of the
+        // structure and content only.
+
+        auto it = _contentDigests.find(root);
+        if (it == _contentDigests.end()) {
+            QCryptographicHash digest (QCryptographicHash::Sha1);
+            addSubtreeToDigest(digest, root);
+            it = _contentDigests.insert(
+                std::make_pair(root, digest.result())
+            ).first;
+        }
+        result.addData(it->second);
+    }
+
+    return result.result();
+}
+
+
+void DaemonManager::trySeedFromCache (
+    DaemonBase & daemon,
+    DaemonFactory const & factory
+) {
+    DAEMONMANAGER
+
+    QString directory;
+    {
+        QMutexLocker lock (&_cacheDirectoryMutex);
+        directory = _cacheDirectory;
+    }
+
+    if (directory.isEmpty())
+        return;
+
+    QByteArray descriptorBytes;
+    {
+        QDataStream stream (&descriptorBytes, QIODevice::WriteOnly);
+        if (not factory.serializeDescriptor(stream, *daemon._descriptor))
+            return;
+    }
+
+    // Mangled type names are stable for a given build, which is as long
+    // as the serialization formats can be trusted to be anyway.  The
+    // content digest is of a canonical form of the observed subtrees, so
+    // it comes out the same in every run (see addSubtreeToDigest).
+
+    QByteArray header;
+    {
+        QDataStream stream (&header, QIODevice::WriteOnly);
+        stream << cacheMagic
+            << cacheFormatVersion
+            << static_cast<quint32>(stream.version())
+            << daemon.getCacheVersion()
+            << QByteArray (daemon._key.info->name())
+            << descriptorBytes
+            << contentDigestOf(daemon._observedRoots);
+    }
+
+    QString fileName = QString("%1.daemon").arg(
+        QString::fromLatin1(
+            QCryptographicHash::hash(header, QCryptographicHash::Sha1)
+                .toHex()
+        )
+    );
+
+    daemon._cachePath = QDir (directory).filePath(fileName);
+    daemon._cacheHeader = header;
+
+    // A file with a different header is from another format, or another
+    // descriptor or content that happened to land on the same name.  It's
+    // left alone, and gets overwritten when this Daemon completes.
+
+    QFile file (daemon._cachePath);
+    if (not file.open(QIODevice::ReadOnly))
+        return;
+
+    if (file.read(header.size()) != header)
+        return;
+
+    daemon._cacheSeed = file.readAll();
+}
+
+
+DaemonManager::AllShardsWriteLocker::AllShardsWriteLocker (
+    DaemonManager & manager
+) :
+    _manager (manager),
+    _isLocked (true)
+{
+    for (auto & shard : _manager._daemonMapShards)
+        shard.lock.lockForWrite();
+}
+
+
+void DaemonManager::AllShardsWriteLocker::unlock () {
+    if (not _isLocked)
+        return;
+
+    for (auto & shard : _manager._daemonMapShards)
+        shard.lock.unlock();
+    _isLocked = false;
+}
+
+
+DaemonManager::AllShardsWriteLocker::~AllShardsWriteLocker () {
+    unlock();
+}
+
+
+auto DaemonManager::discardDaemon (
+    DescriptorMap & map,
+    DescriptorMap::iterator it
+)
+    -> DescriptorMap::iterator
+{
+    DAEMONMANAGER
+
+    DaemonBase & daemon = getDaemon(it->second);
+
+    // Discarding comes before the resumed generation moves on, so this is
+    // the last one it was good for.
+
+    daemon._generation = daemon.getGeneration();
+    daemon._isDiscarded = true;
+
+    _liveDaemons.erase(daemon._serial);
+    forgetParked(daemon._serial);
+    _parkPaused.erase(daemon._serial);
+
+    auto range = _liveKeys.equal_range(daemon._key);
+    for (auto itKey = range.first; itKey != range.second; itKey++) {
+        if (itKey->second == daemon._serial) {
+            _liveKeys.erase(itKey);
+            break;
+        }
+    }
+
+    _priorityPaused.erase(daemon._serial);
+    _agedUntil.erase(daemon._serial);
+    _interactiveRunnable.erase(daemon._serial);
+    _speculativeRunnable.erase(daemon._serial);
+
+    unindexObservedRoots(daemon);
+
+    releaseAwaitingCompletion(daemon._key);
+
+    wakeDaemonsAwaiting(daemon._key);
+
+    // A completed Daemon has nothing left to cancel, and if it was retired
+    // its results have yet to be snapshotted by its replacement.
+
+    if (not daemon._isComplete)
+        it->second.cancel();
+    return map.erase(it);
+}
+
+
+void DaemonManager::keepStale (
+    DaemonBase & daemon,
+    ThinkerPresentBase const & present,
+    qint64 tick
+) {
+    DAEMONMANAGER
+
+    if (
+        not daemon.isServedStale()
+        or not daemon._isComplete
+        or isDetached(daemon)
+    ) {
+        return;
+    }
+
+    // Anything already here for the same Daemon is older, so it's replaced.
+
+    DaemonMapShard & shard = getShard(daemon._interned->hash());
+
+    shard.stale[daemon._key.info][daemon._interned] = StaleDaemon {
+        present, daemon.getGeneration(), tick
+    };
+}
+
+
+void DaemonManager::dropStale (DaemonBase const & daemon) {
+    DAEMONMANAGER
+
+    DaemonMapShard & shard = getShard(daemon._interned->hash());
+
+    // Only the DaemonManager thread writes, so looking first is fine.
+
+    auto itType = shard.stale.find(daemon._key.info);
+    if (itType == shard.stale.end())
+        return;
+
+    auto it = itType->second.find(daemon._interned);
+    if (it == itType->second.end())
+        return;
+
+    QWriteLocker lock (&shard.lock);
+
+    itType->second.erase(it);
+    if (itType->second.empty())
+        shard.stale.erase(itType);
+}
+
+
+void DaemonManager::onCollectGarbage () {
+    DAEMONMANAGER
+
+    // During a pause we're holding pointers to the paused ones, and the
+    // worker is about to decide which of them survive; wait for the next
+    // tick.
+
+    if (_isSelectivePause or _isFullPause)
+        return;
+
+    // Descriptors whose Daemons have all been freed can be forgotten.
+
+    _descriptors.prune();
+
+    QElapsedTimer timer;
+    timer.start();
+    qint64 now = timer.msecsSinceReference();
+
+    // Only this thread changes the map, so the scanning is done without
+    // any locks.  A shard is write locked only while something is being
+    // taken out of it, so readers of the other shards never wait on a
+    // collection.
+
+    // Stale results are only worth keeping while something is working on
+    // replacing them.  They aren't counted against the budget, but there
+    // are only ever as many as the last edits threw out.
+
+    auto isStaleExpired = [&](
+        DaemonMapShard const & shard,
+        std::type_info const * info,
+        StaleDescriptorMap::value_type const & interned
+    ) {
+        auto itLiveType = shard.types.find(info);
+
+        bool isReplacing = (itLiveType != end(shard.types))
+            and (itLiveType->second.count(interned.first) != 0);
+
+        return not isReplacing
+            and (now - interned.second.retiredTick > msecCollectInterval);
+    };
+
+    for (auto & shard : _daemonMapShards) {
+        bool anyExpired = std::any_of(
+            begin(shard.stale), end(shard.stale),
+            [&](StaleTypeMap::value_type const & typeAndMap) {
+                return std::any_of(
+                    begin(typeAndMap.second), end(typeAndMap.second),
+                    [&](StaleDescriptorMap::value_type const & interned) {
+                        return isStaleExpired(
+                            shard, typeAndMap.first, interned
+                        );
+                    }
+                );
+            }
+        );
+
+        if (not anyExpired)
+            continue;
+
+        QWriteLocker lock (&shard.lock);
+
+        auto itType = begin(shard.stale);
+        while (itType != end(shard.stale)) {
+            auto it = begin(itType->second);
+            while (it != end(itType->second)) {
+                if (isStaleExpired(shard, itType->first, *it))
+                    it = itType->second.erase(it);
+                else
+                    it++;
+            }
+
+            if (itType->second.empty())
+                itType = shard.stale.erase(itType);
+            else
+                itType++;
+        }
+    }
+
+    size_t total = 0;
+
+    std::unordered_set<DaemonKey> unfinished;
+
+    for (auto & shard : _daemonMapShards) {
+        for (auto & typeinfoAndMap : shard.types) {
+            for (auto & descriptorAndPresent : typeinfoAndMap.second) {
+                DaemonBase & daemon = getDaemon(descriptorAndPresent.second);
+
+                if (daemon._isComplete)
+                    total += daemon._approximateSize;
+                else
+                    unfinished.insert(daemon._key);
+            }
+        }
+    }
+
+    if (total <= _memoryBudget)
+        return;
+
+    struct Candidate {
+        double keepScore;
+
+        size_t size;
+
+        size_t shardIndex;
+
+        DescriptorMap * map;
+
+        DescriptorMap::iterator it;
+    };
+
+    std::vector<Candidate> candidates;
+
+    for (size_t index = 0; index < numDaemonMapShards; index++) {
+        for (auto & typeinfoAndMap : _daemonMapShards[index].types) {
+            DescriptorMap & map = typeinfoAndMap.second;
+
+            for (auto it = begin(map); it != end(map); it++) {
+                DaemonBase & daemon = getDaemon(it->second);
+
+                if (not daemon._isComplete)
+                    continue;
+
+                {
+                    // Dependents that have since finished (or gone away) don't
+                    // need this any more, so forget them while we're here.
+
+                    QMutexLocker dependentsLock (&daemon._dependentsMutex);
+
+                    auto itDependent = begin(daemon._dependents);
+                    while (itDependent != end(daemon._dependents)) {
+                        if (unfinished.count(*itDependent) == 0)
+                            itDependent = daemon._dependents.erase(itDependent);
+                        else
+                            itDependent++;
+                    }
+
+                    if (not daemon._dependents.empty())
+                        continue;
+                }
+
+                // Cost per byte of recomputing it, discounted by how long it
+                // has been since anyone asked for it.
+
+                qint64 idleMsecs = now - daemon._lastRequestTick;
+                double idleSeconds = std::max<qint64>(0, idleMsecs) / 1000.0;
+
+                double keepScore = (daemon._msecsUsed + 1.0)
+                    / ((daemon._approximateSize + 1.0) * (1.0 + idleSeconds));
+
+                candidates.push_back(Candidate {
+                    keepScore, daemon._approximateSize, index, &map, it
+                });
+            }
+        }
+    }
+
+    std::sort(
+        begin(candidates), end(candidates),
+        [](Candidate const & left, Candidate const & right) {
+            return left.keepScore < right.keepScore;
+        }
+    );
+
+    // Decide everything that goes before taking any locks, then take each
+    // affected shard's lock once.  Erasing from an unordered_map only
+    // invalidates the erased iterator, so the rest are still good.
+
+    std::vector<Candidate> evictions;
+
+    for (Candidate & candidate : candidates) {
+        if (total <= _memoryBudget)
+            break;
+
+        total -= candidate.size;
+        evictions.push_back(candidate);
+    }
+
+    std::stable_sort(
+        begin(evictions), end(evictions),
+        [](Candidate const & left, Candidate const & right) {
+            return left.shardIndex < right.shardIndex;
+        }
+    );
+
+    auto itEviction = begin(evictions);
+    while (itEviction != end(evictions)) {
+        size_t index = itEviction->shardIndex;
+
+        QWriteLocker lock (&_daemonMapShards[index].lock);
+
+        while (
+            (itEviction != end(evictions))
+            and (itEviction->shardIndex == index)
+        ) {
+            discardDaemon(*itEviction->map, itEviction->it);
+            itEviction++;
+        }
+    }
+}
+
+
+void DaemonManager::ensureAllDaemonsPaused (codeplace const & cp) {
+    WORKER
+
+    emit ensureDaemonsPausedBlocking(cp);
+}
+
+
+void DaemonManager::ensureAffectedDaemonsPaused (
+    WriteSet const & writeSet,
+    codeplace const & cp
+) {
+    WORKER
+
+    emit ensureAffectedDaemonsPausedBlocking(writeSet, cp);
+}
+
+
+void DaemonManager::ensureValidDaemonsResumed (codeplace const & cp) {
+    WORKER
+
+    emit ensureDaemonsResumedBlocking(cp);
+}
+
+
+void DaemonManager::ensurePausedDaemonsDiscarded (codeplace const & cp) {
+    WORKER
+
+    emit ensureDaemonsDiscardedBlocking(cp);
+}
+
+
+DaemonManager::~DaemonManager () {
+    // Can't use DAEMONMANAGER here because globalWorker, which holds onto
+    // the pointer for the thread, has been nulled during the destructor
+    // to avoid partial usages.
+
+    hopefully(QThread::currentThread() == thread(), HERE);
+
+    // ThinkerManager and ThinkerPresents demand destruction on the
+    // thread they were started on.  As a Thinker::Present is a shared
+    // pointer under the hood this does not guarantee they will all be
+    // destructed before the thinkerManager is reset, but from the
+    // engine's point of view those are the only handles we have.
+
+    ThinkerManager::ensureThinkersPaused(HERE);
+
+    _pending.clear();
+    _pendingByAge.clear();
+    _pendingKeys.clear();
+
+    _retired.clear();
+    _parked.clear();
+    _parkedOn.clear();
+    _parkPaused.clear();
+    _priorityPaused.clear();
+    _agedUntil.clear();
+    _rootsMayBeFreed.clear();
+    _interactiveRunnable.clear();
+    _speculativeRunnable.clear();
+    _awaitingCompletion.clear();
+    _liveKeys.clear();
+    _liveDaemons.clear();
+    _observersAt.clear();
+    _observersBeneath.clear();
+    _indexedAncestors.clear();
+    for (auto & shard : _daemonMapShards) {
+        shard.stale.clear();
+        shard.types.clear();
+    }
 }
 
 
@@ -25,10 +25,17 @@
 #include <QThread>
 #include <QWaitCondition>
 #include <QMutex>
+#include <QTimer>
+#include <QCryptographicHash>
 
 #include <map>
+#include <set>
+#include <list>
+#include <array>
 
 #include "benzene/daemon.h"
+#include "benzene/operation.h"
+#include "descriptortable.h"
 #include "thinkerqt/thinkermanager.h"
 
 namespace benzene {
@@ -55,6 +62,7 @@ protected:
     void run();
 
 friend bool wasPauseRequested (unsigned long time);
+friend void reportProgress (float fraction, QString const & phase);
 private:
     unique_ptr<DaemonManager> _daemonManager;
 
@@ -117,18 +125,116 @@ private:
 private:
     friend class DaemonManagerThread;
 
+    // Descriptors in the map are interned, so once a request has found the
+    // interned copy of its descriptor, the map lookup is a pointer compare
+    // instead of a walk of the whole tree.  Finding that copy in the table
+    // is still a structural compare against whatever shares its hash; it's
+    // just done once per request instead of once per map probe.
+
+    DescriptorTable _descriptors;
+
+    typedef std::unordered_map<
+        shared_ptr<InternedDescriptor const>,
+        ThinkerPresentBase
+    > DescriptorMap;
+
     // You are not guaranteed to get the same pointer back for type_info
     // each time you call.  But we are using a compare function that
     // dereferences the pointer so that two different pointers that
     // indicate the same value will compare equally
-    std::unordered_map<
+    typedef std::unordered_map<
+        std::type_info const *,
+        DescriptorMap,
+        hash_dereferenced_type_info,
+        equal_dereferenced_type_info
+    > TypeMap;
+
+    // Results of Daemons that were thrown out by an edit, for types that
+    // are served stale (see DaemonData).  They're kept next to the map so
+    // they are looked up under the same shard lock, and stay until the
+    // replacement completes.  If no replacement is asked for they go at
+    // the next garbage collection.
+
+    struct StaleDaemon {
+        ThinkerPresentBase present;
+        quint64 generation;
+        qint64 retiredTick;
+    };
+
+    typedef std::unordered_map<
+        shared_ptr<InternedDescriptor const>,
+        StaleDaemon
+    > StaleDescriptorMap;
+
+    typedef std::unordered_map<
         std::type_info const *,
-        std::unordered_map<methyl::Tree<Descriptor>, ThinkerPresentBase>,
+        StaleDescriptorMap,
         hash_dereferenced_type_info,
         equal_dereferenced_type_info
-    > _daemonMap;
+    > StaleTypeMap;
+
+    // Every render and Daemon thread snapshotting looks in the map, so one
+    // lock for all of it would have its cache line passed around between
+    // all of them.  It's split into shards by descriptor hash, each with
+    // its own lock on its own cache line; a lookup only touches one.
+    //
+    // Only the DaemonManager thread changes the map, so it can read any
+    // shard without locking.  When it walks the whole map to change it, it
+    // takes every shard's lock.  A reader looking up many Daemons at once
+    // may hold several shards' locks too (see tryGetDaemonPresents).  So
+    // anyone holding more than one lock must take them in ascending shard
+    // order, and never take a shard's lock twice; then no one can be
+    // waiting on a lock held by someone waiting on theirs.
+
+    struct alignas(64) DaemonMapShard {
+        QReadWriteLock lock;
+
+        TypeMap types;
+
+        StaleTypeMap stale;
+    };
 
-    QReadWriteLock _daemonMapLock;
+    static size_t const numDaemonMapShards = 16;
+
+    std::array<DaemonMapShard, numDaemonMapShards> _daemonMapShards;
+
+    DaemonMapShard & getShard (size_t descriptorHash) {
+        return _daemonMapShards[descriptorHash % numDaemonMapShards];
+    }
+
+    class AllShardsWriteLocker {
+    public:
+        AllShardsWriteLocker (DaemonManager & manager);
+
+        ~AllShardsWriteLocker ();
+
+        void unlock ();
+
+    private:
+        DaemonManager & _manager;
+
+        bool _isLocked;
+    };
+
+    // Every way a Daemon leaves the map goes through here, so there is one
+    // place that knows how to let go of one.  Caller holds the write lock
+    // for the shard it is in.
+
+    DescriptorMap::iterator discardDaemon (
+        DescriptorMap & map,
+        DescriptorMap::iterator it
+    );
+
+    // Called with the shard write locked, before the Daemon is discarded
+    // and before the resumed generation moves on.
+
+    void keepStale (
+        DaemonBase & daemon,
+        ThinkerPresentBase const & present,
+        qint64 tick
+    );
+
+    void dropStale (DaemonBase const & daemon);
 
 
 public:
@@ -139,39 +245,352 @@ private:
     // and allocating the snapshottable state.  In order to avoid holding up
     // the render or whatever triggered the request for a Daemon that has not
     // yet been started, it is handled by an independent thread.
-    optional<ThinkerPresentBase> createOrRequeueDaemon (
+    optional<ThinkerPresentBase> queueDaemonCreation (
         methyl::Tree<Descriptor> && descriptor,
+        size_t descriptorHash,
         DaemonFactory factory,
         std::type_info const & info,
-        qint64 requestTick
+        qint64 requestTick,
+        DaemonPriority priority
     );
 
 
-signals:
-    void daemonCreateRequest (
-        methyl::NodePrivate * rootHit,
-        shared_ptr<methyl::Context> obs,
+private:
+    // Requests wait in here until the DaemonManager thread gets to them.
+    // Asking again for something that's already waiting only refreshes its
+    // request time (and maybe its priority), so a render asking for the
+    // same few hundred Daemons every frame doesn't add a few hundred more
+    // each time.  Only a request finding no wakeup outstanding signals.
+    //
+    // The most urgent and then most recently asked-for go first, which is
+    // the order they're kept in.  Anything nobody has asked for again in a
+    // while is dropped, unless a Daemon is parked or holding off on its
+    // start until it exists; they are also kept in order of age to find
+    // those.  Requests are matched up by key, but as two descriptors may
+    // share a key the descriptors themselves are compared too.
+    //
+    // A descriptor is made on whichever thread asked, and used on this one.
+    // So as with hits, it is kept dissected while it waits, and only ever
+    // reconstituted by the thread that is looking at it at the moment.
+
+    struct PendingCreation {
+        unique_ptr<methyl::NodePrivate> descriptorOwned;
+        shared_ptr<methyl::Context> context;
+        DaemonFactory factory;
+        std::type_info const * info;
+        size_t descriptorHash;
+        qint64 requestTick;
+        DaemonPriority priority;
+        quint64 sequence;
+    };
+
+    struct PendingOrder {
+        DaemonPriority priority;
+        qint64 requestTick;
+        quint64 sequence;
+    };
+
+    static PendingOrder orderOf (PendingCreation const & pending) {
+        return PendingOrder {
+            pending.priority, pending.requestTick, pending.sequence
+        };
+    }
+
+    struct MoreUrgent {
+        bool operator() (PendingOrder const & a, PendingOrder const & b) const {
+            if (a.priority != b.priority)
+                return a.priority > b.priority;
+            if (a.requestTick != b.requestTick)
+                return a.requestTick > b.requestTick;
+            return a.sequence < b.sequence;
+        }
+    };
+
+    struct LessRecent {
+        bool operator() (PendingOrder const & a, PendingOrder const & b) const {
+            if (a.requestTick != b.requestTick)
+                return a.requestTick < b.requestTick;
+            return a.sequence < b.sequence;
+        }
+    };
+
+    typedef std::map<PendingOrder, PendingCreation, MoreUrgent> PendingMap;
+
+    QMutex _pendingMutex;
+
+    PendingMap _pending;
+
+    std::set<PendingOrder, LessRecent> _pendingByAge;
+
+    std::unordered_multimap<DaemonKey, PendingOrder> _pendingKeys;
+
+    quint64 _nextPendingSequence;
+
+    bool _isWakePending;
+
+    static int const msecPendingTimeout = 2000;
+
+    // A few at a time, so blocking pause requests from the worker don't
+    // have to wait for a whole screenful of Daemons to be created.
+
+    static int const maxCreationsPerWake = 8;
+
+    // These are called with the pending mutex held.
+
+    void addPendingCreation (
+        DaemonKey const & key,
+        methyl::Tree<Descriptor> && descriptor,
         DaemonFactory factory,
-        std::type_info const * info,
-        qint64 requestTick
+        qint64 requestTick,
+        DaemonPriority priority
     );
 
-public slots:
-    // Pointer args are never nullptr, but no refs allowed in slots
-    void onDaemonCreateRequest (
-        methyl::NodePrivate * descriptorOwned,
-        shared_ptr<methyl::Context> context,
-        DaemonFactory factory,
-        std::type_info const * info,
-        qint64 requestTick
+    void insertPending (PendingCreation && pending);
+
+    // Caller holds _pendingMutex.  The pending descriptor is dissected
+    // again before this returns.
+
+    static bool isPendingDescriptor (
+        PendingCreation & pending,
+        methyl::Tree<Descriptor> const & descriptor
+    );
+
+    PendingCreation erasePending (PendingMap::iterator it);
+
+    void signalPendingCreations ();
+
+    bool isAwaited (DaemonKey const & key) const;
+
+    optional<PendingCreation> tryTakeNextPending ();
+
+    void createDaemon (PendingCreation && pending);
+
+    void wakeIfPending ();
+
+signals:
+    void pendingCreationsQueued ();
+
+private slots:
+    void onPendingCreations ();
+
+
+public:
+    DaemonBase & getDaemon (ThinkerPresentBase & present) {
+        return dynamic_cast<DaemonBase &>(getThinkerBase(present));
+    }
+
+private:
+    // If the current thread is a Daemon's, this is that Daemon.  (The
+    // ThinkerManager only gives const access, but what we touch in it is
+    // either atomic, locked, or only used by its own thread.)
+    DaemonBase * tryGetRequestingDaemon ();
+
+    static DaemonPriority inferPriority (DaemonBase const * requester);
+
+
+private:
+    // Raising a Daemon's priority can happen on any thread, and is just an
+    // atomic max.  Passing that on to what it depends on needs the manager's
+    // tables, so that part is queued over to the DaemonManager thread.
+
+    static bool raisePriority (DaemonBase & daemon, DaemonPriority priority);
+
+    // Speculative Daemons paused on account of Interactive ones, by serial
+    // number, so they can be resumed when the Interactive ones are done.
+    // Raising one's priority takes it out of here, and resumes it.
+    //
+    // Rebalancing happens after every creation and completion, so rather
+    // than look through all the Daemons each time, the ones that could be
+    // running are kept track of as they come and go: the Interactive ones
+    // (any of them means the Speculative ones should be paused), and the
+    // Speculative ones (which are what would need pausing).
+    //
+    // A steady stream of Interactive work (or one long Daemon) would keep
+    // the Speculative ones from ever finishing, so they age: one that has
+    // been paused for too long is resumed and left to run for a slice of
+    // time, after which it can be paused again.  Hence the paused ones are
+    // kept with when they were paused, and the aged ones with when their
+    // slice ends.  A timer makes sure the aging is noticed even when no
+    // creation or completion comes along to rebalance.
+
+    std::unordered_map<quint64, qint64> _priorityPaused;
+
+    std::unordered_map<quint64, qint64> _agedUntil;
+
+    std::unordered_set<quint64> _interactiveRunnable;
+
+    std::unordered_set<quint64> _speculativeRunnable;
+
+    unique_ptr<QTimer> _agingTimer;
+
+    static int const msecMaxPriorityPause = 2000;
+
+    static int const msecAgedSlice = 500;
+
+    void trackPriority (DaemonBase & daemon);
+
+    void rebalancePriorities ();
+
+signals:
+    void priorityRaised (quint64 serial);
+
+private slots:
+    void onPriorityRaised (quint64 serial);
+
+
+private:
+    // Every Daemon in the map by serial number, and the serial numbers of
+    // the Daemons with a given key.  Parked Daemons have what they are
+    // still waiting on, and are resumed when the last of that completes.
+    // (If a full pause is in effect they will be resumed with everything
+    // else at the end of it anyway, so no one is woken during it.)  Only
+    // the Daemons this paused for parking are ever resumed by unparking,
+    // as Thinker-Qt won't resume a Thinker that isn't paused.
+
+    quint64 _nextSerial;
+
+    std::unordered_map<quint64, ThinkerPresentBase> _liveDaemons;
+
+    std::unordered_multimap<DaemonKey, quint64> _liveKeys;
+
+    std::unordered_map<quint64, std::unordered_set<DaemonKey>> _parked;
+
+    // The same, the other way around: who is parked waiting on a key.  It
+    // is only changed through these helpers, so the two always agree.
+
+    std::unordered_map<DaemonKey, std::unordered_set<quint64>> _parkedOn;
+
+    void setParked (quint64 serial, std::unordered_set<DaemonKey> && keys);
+
+    void forgetParked (quint64 serial);
+
+    std::unordered_set<quint64> _parkPaused;
+
+    bool _isFullPause;
+
+    bool isKeyComplete (DaemonKey const & key) const;
+
+    void wakeDaemonsAwaiting (DaemonKey const & key);
+
+    // Resumes a parked Daemon unless a pause window will be doing that
+    // anyway when it ends.  Does nothing if it hasn't been paused for the
+    // park yet; when the message saying it parked gets here, whatever it
+    // was waiting on will be found to be done.
+
+    void tryUnpark (ThinkerPresentBase & present);
+
+signals:
+    void daemonParked (quint64 serial, std::vector<DaemonKey> awaiting);
+
+private slots:
+    void onDaemonParked (quint64 serial, std::vector<DaemonKey> awaiting);
+
+
+private:
+    // Serial numbers of the Daemons that declared a key as a prerequisite
+    // and are waiting on it to complete.  (A Daemon with that key going
+    // away also releases them; they'll find out it's missing when they
+    // try to snapshot it, and go Dependent like anyone else.)
+
+    std::unordered_map<DaemonKey, std::vector<quint64>> _awaitingCompletion;
+
+    void queuePrerequisites (
+        DaemonBase & daemon,
+        std::vector<DaemonRequest> && prerequisites
     );
 
+    void releaseAwaitingCompletion (DaemonKey const & key);
+
+signals:
+    void daemonCompleted (quint64 serial);
+
+private slots:
+    void onDaemonCompleted (quint64 serial);
 
 public:
+    // If the Daemon is found, the interned form of its descriptor can be
+    // handed back, so typed keys can find it again without a descriptor.
+
     optional<ThinkerPresentBase> tryGetDaemonPresent (
         methyl::Tree<Descriptor> && descriptor,
         DaemonFactory factory,
-        std::type_info const & info
+        std::type_info const & info,
+        optional<DaemonPriority> priority,
+        shared_ptr<InternedDescriptor const> * internedOut
+    );
+
+    // All the requests are looked up with the shards they fall in locked at
+    // once, and only Daemons valid for the generation that is handed back
+    // are returned.  Misses are queued together.
+
+    std::vector<optional<ThinkerPresentBase>> tryGetDaemonPresents (
+        std::vector<DaemonRequest> && requests,
+        quint64 & generation
+    );
+
+    // Only finds; a miss doesn't queue anything, because there's no
+    // factory to queue it with.
+
+    optional<ThinkerPresentBase> tryGetInternedDaemonPresent (
+        shared_ptr<InternedDescriptor const> const & descriptor,
+        std::type_info const & info,
+        optional<DaemonPriority> priority
+    );
+
+    // Stale results, along with the generation they were computed for.
+    // Nothing is queued or counted as a request; that's for the lookup of
+    // the Daemon itself.
+
+    optional<ThinkerPresentBase> tryGetStaleDaemonPresent (
+        methyl::Tree<Descriptor> const & descriptor,
+        std::type_info const & info,
+        quint64 & generation
+    );
+
+    optional<ThinkerPresentBase> tryGetStaleInternedPresent (
+        shared_ptr<InternedDescriptor const> const & descriptor,
+        std::type_info const & info,
+        quint64 & generation
+    );
+
+private:
+    // Anyone in snapshotDaemonWithin() waits on this, and is woken each
+    // time a Daemon is created or completes to see if it was theirs.  The
+    // epoch counts those events, so that one happening between a waiter
+    // looking and waiting isn't missed.
+
+    QMutex _settleMutex;
+
+    QWaitCondition _settleCondition;
+
+    quint64 _settleEpoch;
+
+public:
+    quint64 getSettleEpoch () {
+        QMutexLocker lock (&_settleMutex);
+        return _settleEpoch;
+    }
+
+    void notifySettled () {
+        QMutexLocker lock (&_settleMutex);
+        _settleEpoch++;
+        _settleCondition.wakeAll();
+    }
+
+    void waitForSettle (quint64 epoch, unsigned long msecs) {
+        QMutexLocker lock (&_settleMutex);
+        if (_settleEpoch == epoch)
+            _settleCondition.wait(&_settleMutex, msecs);
+    }
+
+private:
+    // Bookkeeping for a Daemon that was asked for and found.  Caller holds
+    // at least the read lock on the map.
+
+    void noteDaemonRequested (
+        ThinkerPresentBase & present,
+        DaemonBase * requester,
+        DaemonPriority priority
     );
 
 friend class DaemonBase;
@@ -198,6 +617,23 @@ public:
     void ensureAllDaemonsPaused (codeplace const & cp);
     void ensureValidDaemonsResumed (codeplace const & cp);
 
+    // Pauses only the daemons whose observed roots overlap the write set
+    // (one contains the other).  Everything else keeps running while the
+    // operation is invoked.  ensureValidDaemonsResumed is still the way
+    // to end the pause window, and only rechecks the daemons paused here.
+    void ensureAffectedDaemonsPaused (
+        WriteSet const & writeSet,
+        codeplace const & cp
+    );
+
+    // If the worker replaces the document wholesale (as when committing a
+    // speculative fork), or swaps subtrees in and out of it (as for an
+    // undo), then no observer can be trusted to notice: the nodes they were
+    // watching are gone or detached, not modified.  So every daemon that
+    // is currently paused is thrown away; when everything was paused that
+    // means all of them.  Must be called before the old nodes are freed.
+    void ensurePausedDaemonsDiscarded (codeplace const & cp);
+
     // This is how we get the actual pause requests to originate from
     // the Daemon Manager thread.  There is an assertion that all
     // ThinkerPresent objects are destroyed from the same thread that
@@ -207,20 +643,239 @@ public:
 
 signals:
     void ensureDaemonsPausedBlocking (codeplace cp);
+    void ensureAffectedDaemonsPausedBlocking (WriteSet writeSet, codeplace cp);
     void ensureDaemonsResumedBlocking (codeplace cp);
+    void ensureDaemonsDiscardedBlocking (codeplace cp);
 
 private slots:
     void onEnsureDaemonsPausedBlocking (codeplace cp);
+    void onEnsureAffectedDaemonsPausedBlocking (
+        WriteSet writeSet,
+        codeplace cp
+    );
     void onEnsureDaemonsResumedBlocking (codeplace cp);
+    void onEnsureDaemonsDiscardedBlocking (codeplace cp);
+
+public:
+    // Reading parents from the DaemonManager thread is unobserved, which is
+    // only safe because it happens while nothing is writing; see
+    // Worker::observerInEffect().
+
+    static bool isSameOrAncestorOf (
+        methyl::Node<methyl::Accessor const> ancestor,
+        methyl::Node<methyl::Accessor const> node
+    );
+
+    // A write root stays in the document (see WriteSet), but anything
+    // strictly beneath one may be freed by the write.  Only meaningful
+    // before the write happens.
+
+    static bool isBeneathWriteRoot (
+        methyl::Node<methyl::Accessor const> node,
+        WriteSet const & writeSet
+    );
+
+private:
+    // Asking every Daemon whether a WriteSet touches it makes each edit
+    // cost in proportion to how many Daemons are cached.  So each observed
+    // root is indexed under itself and also under all of its ancestors.
+    // A write root then finds the Daemons watching beneath it with one
+    // lookup, and those watching above it with a walk up its ancestors.
+    //
+    // Ancestors are as of when the Daemon was indexed.  The only way they
+    // could change is a write above the root, which makes the Daemon an
+    // affected one...so survivors of a pause are indexed again.
+
+    typedef std::unordered_map<
+        methyl::Node<methyl::Accessor const>,
+        std::unordered_set<quint64>
+    > ObserverIndex;
+
+    ObserverIndex _observersAt;
+
+    ObserverIndex _observersBeneath;
+
+    std::unordered_map<
+        quint64,
+        std::vector<methyl::Node<methyl::Accessor const>>
+    > _indexedAncestors;
+
+    void indexObservedRoots (DaemonBase const & daemon);
+
+    void unindexObservedRoots (DaemonBase const & daemon);
+
+    std::unordered_set<quint64> findAffected (WriteSet const & writeSet);
+
+    // An observer of a subtree won't see that subtree being removed from
+    // the document, so that's checked separately.
+
+    static bool isDetached (DaemonBase const & daemon);
+
+    // Everything still in the map after a resume is valid for the document
+    // as it is, so rather than stamping each Daemon (which would mean
+    // visiting all of them) the generation is noted here.  A Daemon's
+    // generation is the later of this and the one it was created in.
+
+    std::atomic<quint64> _resumedGeneration;
+
+public:
+    quint64 getResumedGeneration () const {
+        return _resumedGeneration;
+    }
+
+private:
+    // Finding a Daemon's place in the map from the Daemon, for when it was
+    // found some other way than walking the map.
+
+    std::pair<DescriptorMap *, DescriptorMap::iterator> locateDaemon (
+        DaemonBase const & daemon
+    );
+
+    // When only some daemons were paused, the rest are still running and
+    // must not be second-guessed on resume (their observers may well be
+    // mid-update).  So we remember exactly which ones we paused, by serial
+    // number.  During such a window, creation requests are left pending; a
+    // new daemon could otherwise start reading a subtree being written.
+    // The write set is kept to say what changed, for incremental Daemons.
+
+    bool _isSelectivePause;
+
+    std::unordered_set<quint64> _selectivelyPaused;
+
+    WriteSet _selectiveWriteSet;
+
+    // Paused Daemons observing from beneath a write root may have their
+    // roots freed, and then nothing can be asked of those nodes at resume
+    // time.  So this is worked out at the start of the window, while they
+    // are still there, and such Daemons are taken to be detached.
+
+    std::unordered_set<quint64> _rootsMayBeFreed;
+
+
+private:
+    // Results of incremental Daemons that were thrown out by an edit, kept
+    // for whichever Daemon replaces them (see DaemonData).  Edits made
+    // later under what they observed are added to their changed roots, so
+    // what's handed over covers everything since they were computed.  Only
+    // so many are kept; they don't count against the memory budget, and
+    // anything that can't say what changed (like an undo) drops them all.
+    //
+    // Their nodes aren't watched by any observer, so nothing says when one
+    // has been freed.  Instead, at the start of each window, the ones with
+    // nodes the coming write could free are dropped: any beneath a write
+    // root, or all of them for a full pause.  Whatever is left is sure to
+    // still be there when the changes are noted at the end of the window.
+
+    struct RetiredDaemon {
+        std::type_info const * info;
+        shared_ptr<InternedDescriptor const> interned;
+        ThinkerPresentBase present;
+        std::vector<methyl::Node<methyl::Accessor const>> observedRoots;
+        std::vector<methyl::Node<methyl::Accessor const>> changedRoots;
+    };
+
+    std::list<RetiredDaemon> _retired;
+
+    static size_t const maxRetired = 64;
+
+    // With no write set, everything observed is taken to have changed.
+
+    static void noteChanges (
+        std::vector<methyl::Node<methyl::Accessor const>> const & observed,
+        WriteSet const * writeSet,
+        std::vector<methyl::Node<methyl::Accessor const>> & changed
+    );
+
+    void retireDaemon (
+        DaemonBase const & daemon,
+        ThinkerPresentBase const & present,
+        WriteSet const * writeSet
+    );
+
+    void dropRetiredBeneath (WriteSet const & writeSet);
+
+    void updateRetired (WriteSet const * writeSet);
+
+    void tryTakeRetired (DaemonBase & daemon);
+
+
+private:
+    // Completed Daemons are kept around in case they are asked for again,
+    // but not without limit.  Periodically the total of their approximate
+    // sizes is compared against the budget, and if it's over then the ones
+    // least worth keeping are freed until it isn't.  A Daemon is worth more
+    // if it was requested recently and if it took long to compute for its
+    // size.  One that an unfinished Daemon has snapshotted is never freed.
+
+    std::atomic<size_t> _memoryBudget;
+
+    unique_ptr<QTimer> _collectTimer;
+
+    static int const msecCollectInterval = 5000;
+
+    static size_t const defaultMemoryBudget = 256 * 1024 * 1024;
+
+public:
+    void setMemoryBudget (size_t bytes) {
+        _memoryBudget = bytes;
+    }
+
+private slots:
+    void onCollectGarbage ();
+
+
+private:
+    // Results of persistent Daemons are saved under here, named by their
+    // type, descriptor, and the content of what they observe.  Empty means
+    // there's no cache.  Each file begins with a header giving all of those
+    // (and the format versions), which has to match exactly for the file to
+    // be used; the name only finds it.  The content digests are remembered
+    // for as long as the document stays at the same generation, as the
+    // roots tend to be the same for many Daemons (often the whole document).
+
+    static quint32 const cacheMagic = 0x425a4443; // "BZDC"
+
+    static quint32 const cacheFormatVersion = 3;
+
+    QMutex _cacheDirectoryMutex;
+
+    QString _cacheDirectory;
+
+    quint64 _contentDigestGeneration;
+
+    std::unordered_map<methyl::Node<methyl::Accessor const>, QByteArray>
+        _contentDigests;
+
+    static void addSubtreeToDigest (
+        QCryptographicHash & digest,
+        methyl::Node<methyl::Accessor const> root
+    );
+
+    QByteArray contentDigestOf (
+        std::vector<methyl::Node<methyl::Accessor const>> const & roots
+    );
+
+    void trySeedFromCache (
+        DaemonBase & daemon,
+        DaemonFactory const & factory
+    );
+
+public:
+    void setCacheDirectory (QString const & path) {
+        QMutexLocker lock (&_cacheDirectoryMutex);
+        _cacheDirectory = path;
+    }
 
 
 #ifdef NEED_DAEMON_ENUMERATION
 // Can enumerate thinkers, do we need this enumeration specifically?
 private:
     void forAllDaemons(std::function<void(DaemonBase &)> fn) {
-        for (auto & typeinfoAndMap : _daemonMap) {
-            for (auto & nodeAndDaemon : typeinfoAndMap.second) {
-                fn(*nodeAndDaemon.second);
+        for (auto & shard : _daemonMapShards) {
+            for (auto & typeinfoAndMap : shard.types) {
+                for (auto & nodeAndDaemon : typeinfoAndMap.second) {
+                    fn(*nodeAndDaemon.second);
+                }
             }
         }
     }
@@ -240,4 +895,8 @@ bool isDaemonManagerThreadCurrent();
 
 } // end namespace benzene
 
+Q_DECLARE_METATYPE(benzene::WriteSet)
+
+Q_DECLARE_METATYPE(std::vector<benzene::DaemonKey>)
+
 #endif
@@ -0,0 +1,111 @@
+//
+// descriptortable.cpp
+// This file is part of Benzene
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Benzene is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Benzene is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Benzene.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://benzene.hostilefork.com/ for more information on this project
+//
+
+#include "descriptortable.h"
+#include "benzene/application.h"
+
+namespace benzene {
+
+
+///////////////////////////////////////////////////////////////////////////////
+//
+// benzene::DescriptorTable
+//
+
+DescriptorTable::DescriptorTable ()
+{
+}
+
+
+shared_ptr<InternedDescriptor const> DescriptorTable::intern (
+    methyl::Tree<Descriptor> && descriptor,
+    size_t hash
+) {
+    DAEMONMANAGER
+
+    Shard & shard = getShard(hash);
+
+    QWriteLocker lock (&shard.lock);
+
+    auto range = shard.entries.equal_range(hash);
+    auto it = range.first;
+    while (it != range.second) {
+        shared_ptr<InternedDescriptor const> entry = it->second.lock();
+        if (not entry) {
+            it = shard.entries.erase(it);
+            continue;
+        }
+
+        // Same hash is only a hint; it has to actually be the same tree.
+
+        if (entry->tree() == descriptor)
+            return entry;
+        it++;
+    }
+
+    auto entry = make_shared<InternedDescriptor const>(
+        std::move(descriptor), hash
+    );
+    shard.entries.insert(std::make_pair(hash, entry));
+    return entry;
+}
+
+
+shared_ptr<InternedDescriptor const> DescriptorTable::tryFind (
+    methyl::Tree<Descriptor> const & descriptor,
+    size_t hash
+) const {
+    Shard const & shard = getShard(hash);
+
+    QReadLocker lock (&shard.lock);
+
+    auto range = shard.entries.equal_range(hash);
+    for (auto it = range.first; it != range.second; it++) {
+        shared_ptr<InternedDescriptor const> entry = it->second.lock();
+        if (entry and (entry->tree() == descriptor))
+            return entry;
+    }
+    return nullptr;
+}
+
+
+void DescriptorTable::prune () {
+    DAEMONMANAGER
+
+    for (Shard & shard : _shards) {
+        QWriteLocker lock (&shard.lock);
+
+        auto it = begin(shard.entries);
+        while (it != end(shard.entries)) {
+            if (it->second.expired())
+                it = shard.entries.erase(it);
+            else
+                it++;
+        }
+    }
+}
+
+
+DescriptorTable::~DescriptorTable ()
+{
+}
+
+} // end namespace benzene
@@ -0,0 +1,127 @@
+//
+// descriptortable.h
+// This file is part of Benzene
+// Copyright (C) 2002-2014 HostileFork.com
+//
+// Benzene is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// Benzene is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with Benzene.  If not, see <http://www.gnu.org/licenses/>.
+//
+// See http://benzene.hostilefork.com/ for more information on this project
+//
+
+#ifndef BENZENE_DESCRIPTORTABLE_H
+#define BENZENE_DESCRIPTORTABLE_H
+
+#include <unordered_map>
+#include <array>
+
+#include <QReadWriteLock>
+
+#include "benzene/daemon.h"
+
+namespace benzene {
+
+
+// One canonical copy of a descriptor, along with its hash so it only has
+// to be worked out once.  It is never modified after being interned, so
+// two of these are the same descriptor exactly when they are the same
+// object...and anything keyed by them can compare pointers.
+
+class InternedDescriptor {
+public:
+    InternedDescriptor (methyl::Tree<Descriptor> && tree, size_t hash) :
+        _tree (std::move(tree)),
+        _hash (hash)
+    {
+    }
+
+    methyl::Tree<Descriptor> const & tree () const {
+        return _tree;
+    }
+
+    methyl::Node<Descriptor const> root () const {
+        return _tree.root();
+    }
+
+    size_t hash () const {
+        return _hash;
+    }
+
+private:
+    methyl::Tree<Descriptor> _tree;
+
+    size_t _hash;
+};
+
+
+
+// The table itself only holds weak references; the entries live as long
+// as something that was interned is using them.  A descriptor asked for
+// by more than one kind of Daemon is stored once.  Lookups can come from
+// any thread, though interning is only done by the DaemonManager.  Like
+// the Daemon map, it's split into shards by hash so that lookups from
+// different threads usually aren't fighting over the same lock.
+
+class DescriptorTable {
+public:
+    DescriptorTable ();
+
+    ~DescriptorTable ();
+
+public:
+    shared_ptr<InternedDescriptor const> intern (
+        methyl::Tree<Descriptor> && descriptor,
+        size_t hash
+    );
+
+    // Finding doesn't intern; if nothing has been interned that matches
+    // the descriptor, then nothing can be keyed by it yet either.  The
+    // hash only narrows down the entries to look at, each of which is
+    // compared as a tree.  Only a read lock on the shard is taken, so any
+    // number of threads can be finding at once.
+
+    shared_ptr<InternedDescriptor const> tryFind (
+        methyl::Tree<Descriptor> const & descriptor,
+        size_t hash
+    ) const;
+
+    // Forget the entries that no one is using any more.
+
+    void prune ();
+
+private:
+    struct alignas(64) Shard {
+        mutable QReadWriteLock lock;
+
+        std::unordered_multimap<
+            size_t,
+            std::weak_ptr<InternedDescriptor const>
+        > entries;
+    };
+
+    static size_t const numShards = 16;
+
+    std::array<Shard, numShards> _shards;
+
+    Shard & getShard (size_t hash) {
+        return _shards[hash % numShards];
+    }
+
+    Shard const & getShard (size_t hash) const {
+        return _shards[hash % numShards];
+    }
+};
+
+} // end namespace benzene
+
+#endif
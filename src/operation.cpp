@@ -42,6 +42,15 @@ methyl::Node<methyl::Accessor> OperationBase::getDocument() const {
 
     auto & worker = getApplication<ApplicationBase>().getWorker();
 
+    // During a speculative invocation the operation is handed the fork
+    // instead, and has no way of telling the difference.
+
+    if (worker._isSpeculating) {
+        return methyl::globalEngine->contextualNodeRef(
+            (*worker._speculativeDocument).root(), worker._dummyContext
+        );
+    }
+
     return methyl::globalEngine->contextualNodeRef(
         (*worker._document).root(), worker._dummyContext
     );
@@ -57,6 +57,13 @@ OperationStatusBar::OperationStatusBar (QWidget * parent) :
     addWidget(_statusBarIcon);
     addWidget(_statusBarMessage);
 
+    _statusBarProgress = new QProgressBar (this);
+    _statusBarProgress->setRange(0, 10000);
+    _statusBarProgress->setMaximumWidth(120);
+    _statusBarProgress->setTextVisible(false);
+    _statusBarProgress->hide();
+    addPermanentWidget(_statusBarProgress);
+
     ApplicationBase & app = dynamic_cast<ApplicationBase&>(
         *QApplication::instance()
     );
@@ -98,6 +105,7 @@ void OperationStatusBar::showInformation (
 
     _statusBarIcon->setPixmap(_pixmapInformation);
     _statusBarMessage->setText(message);
+    _statusBarProgress->hide();
 }
 
 
@@ -108,6 +116,20 @@ void OperationStatusBar::showError (
 
     _statusBarIcon->setPixmap(_pixmapError);
     _statusBarMessage->setText(message);
+    _statusBarProgress->hide();
+}
+
+
+void OperationStatusBar::showProgress (optional<float> fraction) {
+    GUI
+
+    if (not fraction) {
+        _statusBarProgress->hide();
+        return;
+    }
+
+    _statusBarProgress->setValue(static_cast<int>(*fraction * 10000));
+    _statusBarProgress->show();
 }
 
 
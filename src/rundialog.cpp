@@ -51,6 +51,13 @@ RunDialog::RunDialog (QWidget *parent)
         Qt::DirectConnection
     );
 
+    // One press is enough; the operation may take a moment to notice.
+    connect(
+        _cancelButton, &QPushButton::clicked,
+        this, [this]() { _cancelButton->setEnabled(false); },
+        Qt::DirectConnection
+    );
+
     connect(
         _terminateButton, &QPushButton::clicked,
         this, &RunDialog::terminated,
@@ -82,6 +89,27 @@ void RunDialog::setProgressString (QString message) {
 }
 
 
+void RunDialog::setCancellable (bool cancellable) {
+    _cancelButton->setEnabled(cancellable);
+}
+
+
+void RunDialog::setProgress (optional<float> fraction, QString phase) {
+    if (not fraction) {
+        _progress->setMaximum(0);
+        return;
+    }
+
+    _progress->setMaximum(10000);
+    _progress->setValue(static_cast<int>(*fraction * 10000));
+
+    if (phase.isEmpty())
+        _progress->setFormat("%p%");
+    else
+        _progress->setFormat(phase + " (%p%)");
+}
+
+
 void RunDialog::timerEvent (QTimerEvent * event) {
     if (not _tickShown) {
         QElapsedTimer timer;
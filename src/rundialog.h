@@ -38,9 +38,9 @@ class QProgressBar;
 //
 // benzene::RunDialog
 //
-// The framework is not currently set up in such a way to have percentage
-// progress notifications... although it could easily show something like the
-// elapsed time.
+// Operations may report progress with benzene::reportProgress(), in which
+// case the bar shows a percentage (and the phase, if given).  Otherwise it
+// is an indeterminate "busy" bar.
 //
 // One idea in the original Benzene framework was to facilitate the termination
 // of operations that were running too long, and to make restoring from the
@@ -62,6 +62,14 @@ public:
 
     void setProgressString (QString message);
 
+    // Only operations that know how to stop early (and let the framework
+    // roll them back) offer a working Cancel button.
+    void setCancellable (bool cancellable);
+
+    // With no fraction the bar is shown as "busy"; once an operation has
+    // reported some progress it becomes determinate.
+    void setProgress (optional<float> fraction, QString phase);
+
 
 private:
     void timerEvent (QTimerEvent * event) override;
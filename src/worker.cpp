@@ -19,10 +19,13 @@
 // See http://benzene.hostilefork.com/ for more information on this project
 //
 
+#include <algorithm>
+
 #include "worker.h"
 #include "benzene/application.h"
 
 using methyl::NodePrivate;
+using methyl::Node;
 using methyl::Tree;
 using methyl::Accessor;
 using methyl::Tag;
@@ -39,6 +42,54 @@ namespace benzene {
 methyl::Tag const globalRootOfDocumentTag (HERE);
 
 
+namespace {
+
+void noteFailure (optional<QString> & firstFailure, QString const & message) {
+    if (not firstFailure)
+        firstFailure = message;
+}
+
+
+// Where a node sits, as the tag and the index among same-tagged siblings at
+// each level going down from the root.  Finds the same place again in an
+// exact copy of the tree.
+
+typedef std::vector<std::pair<Tag, int>> NodePath;
+
+NodePath pathOfNode (Node<Accessor> node) {
+    NodePath path;
+
+    while (node->hasParent()) {
+        int index = 0;
+        Node<Accessor> sibling = node;
+        while (sibling->hasPreviousSiblingInTag()) {
+            sibling = sibling->getPreviousSiblingInTag();
+            index++;
+        }
+
+        path.emplace_back(node->getTagInParent(), index);
+        node = node->getParent();
+    }
+
+    std::reverse(begin(path), end(path));
+    return path;
+}
+
+Node<Accessor> nodeAtPath (Node<Accessor> root, NodePath const & path) {
+    Node<Accessor> node = root;
+
+    for (auto & step : path) {
+        node = node->getFirstChildInTag(step.first);
+        for (int index = 0; index < step.second; index++)
+            node = node->getNextSiblingInTag();
+    }
+
+    return node;
+}
+
+} // end anonymous namespace
+
+
 //////////////////////////////////////////////////////////////////////////////
 //
 // benzene::WorkerThread
@@ -119,6 +170,14 @@ WorkerThread::~WorkerThread () {
 Worker::Worker (WorkerThread & workerThread) :
     _workerThread (workerThread),
     _daemonManagerThread (new DaemonManagerThread ()),
+    _documentGeneration (0),
+    _speculativeGeneration (0),
+    _isSpeculating (false),
+    _cancelRequested (false),
+    _isCancelObservable (false),
+    _progressPermyriad (-1),
+    _progressOperationIndex (0),
+    _progressOperationCount (1),
     _mainWidget (nullptr),
     _status (OperationStatus::None, HERE)
 {
@@ -153,8 +212,14 @@ Worker::Worker (WorkerThread & workerThread) :
     );
 
     connect(
-        this, &Worker::queueInvokeOperationMaybe,
-        this, &Worker::onQueueInvokeOperationMaybe,
+        this, &Worker::queuedOperationsPending,
+        this, &Worker::onQueuedOperationsPending,
+        Qt::QueuedConnection
+    );
+
+    connect(
+        this, &Worker::speculationPending,
+        this, &Worker::onSpeculationPending,
         Qt::QueuedConnection
     );
 }
@@ -174,8 +239,22 @@ shared_ptr<Observer> Worker::observerInEffect () {
     if (isGuiThreadCurrent() || isWorkerThreadCurrent())
         return nullptr;
 
+    QThread * thread = QThread::currentThread();
+
     QReadLocker lock (&_observersLock);
-    auto result = _threadsToObservers.value(QThread::currentThread());
+    auto result = _threadsToObservers.value(thread);
+
+    // The DaemonManager thread reads the document on its own account too,
+    // such as walking up from a write root to see whose observed subtree
+    // it falls in.  Those reads belong to no Daemon, so like the worker's
+    // (and the GUI's) they go unobserved.  Only while it's constructing a
+    // Daemon is there an observer registered for it.  It only reads when
+    // nothing is writing: inside a pause it's doing the blocking request
+    // the worker is waiting on, and creation waits for pauses to end.
+
+    if (result == nullptr and isDaemonManagerThreadCurrent())
+        return nullptr;
+
     hopefully(result != nullptr, HERE);
     return result;
 }
@@ -244,7 +323,11 @@ void Worker::timerEvent (QTimerEvent * event) {
 
         emit hoveringOperation((*_operation)->getDescription());
 
-        updateNoLaterThan(30);
+        // Speculating can take a while, so the hover gets drawn first.
+
+        emit speculationPending();
+
+        notifyAllBenzenes();
     }
     else if (
         _nextUpdateTimerId and (event->timerId() == *_nextUpdateTimerId)
@@ -282,6 +365,14 @@ void Worker::receiveGlanceHit (
     optional<methyl::Tree<Hit>> hit
         = methyl::globalEngine->reconstituteTree<Hit>(ownedHit, context);
 
+    // Mouse motion inside the same hit will keep glancing at it; only a
+    // different hit makes the speculative result irrelevant.
+
+    if (not hit or (_speculativeHit != hit))
+        discardSpeculation();
+
+    bool isNewHit = _hitListTree.empty() or (_hitListTree[0] != hit);
+
     _hitListTree.clear();
 
     if (hit) {
@@ -299,6 +390,12 @@ void Worker::receiveGlanceHit (
 
     if (_operation and (_status == OperationStatus::Glancing)) {
         emit glancingOperation((*_operation)->getDescription());
+
+        // Glance hits arrive on every mouse move, but the operation (and
+        // what it needs) only changes when the hit does.
+
+        if (isNewHit)
+            prefetchDaemons((*_operation)->getDaemonsToPrefetch());
     } else {
         emit nullOperation();
     }
@@ -321,6 +418,9 @@ void Worker::receiveFirstHit (
     optional<methyl::Tree<Hit>> hit
         = methyl::globalEngine->reconstituteTree<Hit>(ownedHit, context);
 
+    if (not hit or (_speculativeHit != hit))
+        discardSpeculation();
+
     _hitListTree.clear();
 
     if (hit) {
@@ -430,9 +530,13 @@ void Worker::receiveLastHit (
     notifyAllBenzenes();
 
     if (_operation) {
-        invokeOperation(std::move(*_operation));
+        if (not tryCommitSpeculation())
+            invokeOperation(std::move(*_operation));
+        _operation = nullopt;
     }
 
+    discardSpeculation();
+
     _status.assign(OperationStatus::None, HERE);
 
     // REVIEW: When an operation is over, we need a way to force a new
@@ -448,27 +552,679 @@ void Worker::receiveLastHit (
 void Worker::invokeOperation (unique_ptr<OperationBase> operation) {
     WORKER
 
-    emit beginInvokeOperation(operation->getDescription());
+    std::vector<unique_ptr<OperationBase>> operations;
+    operations.push_back(std::move(operation));
+
+    invokeOperations(std::move(operations));
+}
+
+
+void Worker::invokeOperations (
+    std::vector<unique_ptr<OperationBase>> && operations
+) {
+    WORKER
+
+    hopefully(not operations.empty(), HERE);
 
-    _daemonManagerThread->getManager().ensureAllDaemonsPaused(HERE);
+    QString description = operations.front()->getDescription();
+    if (operations.size() > 1) {
+        description += QString(" (and %1 more)").arg(operations.size() - 1);
+    }
 
-    optional<Tree<methyl::Error>> result = operation->invoke();
+    bool cancellable = std::any_of(
+        begin(operations), end(operations),
+        [](unique_ptr<OperationBase> const & operation) {
+            return operation->isCancellable();
+        }
+    );
 
-    _daemonManagerThread->getManager().ensureValidDaemonsResumed(HERE);
+    _cancelRequested = false;
 
-    if (result) {
-        emit endInvokeOperation(false, (*result)->getDescription());
+    _progressPermyriad = -1;
+    {
+        QMutexLocker lock (&_progressPhaseMutex);
+        _progressPhase = QString ();
+    }
+    _progressOperationIndex = 0;
+    _progressOperationCount = operations.size();
+
+    emit beginInvokeOperation(description, cancellable);
+
+    // A failure doesn't stop the rest of the batch, any more than it would
+    // have if they had been invoked one at a time.  But it is the first
+    // failure that gets reported.
+
+    optional<QString> firstFailure;
+
+    // A two-phase operation has to prepare while the daemons are running,
+    // so it can't share a pause window with operations before it.  Each
+    // one starts a new window, which the operations after it may join.
+
+    auto first = begin(operations);
+    while (first != end(operations)) {
+        auto last = std::find_if(
+            std::next(first), end(operations),
+            [](unique_ptr<OperationBase> const & operation) {
+                return operation->isTwoPhase();
+            }
+        );
+
+        invokeOperationWindow(first, last, firstFailure);
+
+        if (_cancelRequested)
+            break;
+
+        first = last;
+    }
+
+    _cancelRequested = false;
+
+    if (firstFailure) {
+        emit endInvokeOperation(false, *firstFailure);
     } else {
         emit endInvokeOperation(
             true,
-            operation->getDescription() + " completed successfully."
+            description + " completed successfully."
+        );
+    }
+
+    updateNoLaterThan(msecPerceivable);
+}
+
+
+void Worker::invokeOperationWindow (
+    OperationIterator first,
+    OperationIterator last,
+    optional<QString> & firstFailure
+) {
+    WORKER
+
+    // prepare() runs here on the worker, and nothing else writes to the
+    // document, so it can't change before the operation is invoked.  The
+    // gain is only that the daemons are still running while it works.
+
+    if ((*first)->isTwoPhase()) {
+        _isCancelObservable = true;
+        optional<Tree<methyl::Error>> result = (*first)->prepare();
+        _isCancelObservable = false;
+
+        if (_cancelRequested) {
+            // Nothing has been written yet, so there is nothing to roll back
+            // and no journal entry to make.  But the operation didn't run,
+            // and the batch mustn't be reported as having completed.
+
+            noteFailure(
+                firstFailure, (*first)->getDescription() + " was canceled."
+            );
+            return;
+        }
+
+        if (result) {
+            noteFailure(firstFailure, (*result)->getDescription());
+
+            _progressOperationIndex++;
+
+            first++;
+            if (first == last)
+                return;
+        }
+    }
+
+    // If every operation in the window knows where it will write, only the
+    // daemons observing those places need to stop.  One operation that
+    // doesn't know means everyone stops.
+
+    optional<WriteSet> writeSet = WriteSet ();
+
+    for (auto it = first; it != last; it++) {
+        optional<WriteSet> operationWrites = (*it)->getWriteSet();
+
+        if (not operationWrites)
+            writeSet = nullopt;
+
+        if (writeSet) {
+            (*writeSet).insert(
+                end(*writeSet), begin(*operationWrites), end(*operationWrites)
+            );
+        }
+    }
+
+    auto & manager = _daemonManagerThread->getManager();
+
+    if (writeSet)
+        manager.ensureAffectedDaemonsPaused(*writeSet, HERE);
+    else
+        manager.ensureAllDaemonsPaused(HERE);
+
+    auto it = first;
+
+    while ((it != last) and not _cancelRequested) {
+        invokeOperationAlone(it, firstFailure);
+        it++;
+    }
+
+    // Even a failed operation may have written something before failing,
+    // so the window as a whole is one new version of the document.  This
+    // must happen before the resume, which stamps surviving daemons as
+    // being valid for whatever the current generation is.
+
+    advanceDocumentGeneration();
+
+    manager.ensureValidDaemonsResumed(HERE);
+}
+
+
+void Worker::invokeOperationAlone (
+    OperationIterator it,
+    optional<QString> & firstFailure
+) {
+    WORKER
+
+    auto & manager = _daemonManagerThread->getManager();
+
+    // The journal entry doubles as the rollback for a cancellation.
+
+    JournalChange change = prepareJournalChange(**it);
+
+    _isCancelObservable = (*it)->isCancellable();
+    optional<Tree<methyl::Error>> result = (*it)->invoke();
+    _isCancelObservable = false;
+
+    // Operations that never report progress still move the bar along
+    // when they are part of a batch.
+
+    advanceOperationProgress();
+
+    if (_cancelRequested and (*it)->isCancellable()) {
+        rollBackJournalChange(change);
+
+        // Whatever the paused daemons were watching in there has been
+        // taken out of the document, and is freed with the entry at the
+        // end of this scope.
+
+        manager.ensurePausedDaemonsDiscarded(HERE);
+
+        noteFailure(firstFailure, (*it)->getDescription() + " was canceled.");
+        return;
+    }
+
+    // Even an operation that failed may have written something before
+    // it did, and undoing that is as meaningful as undoing a success.
+
+    commitJournalChange(std::move(change));
+
+    if (result)
+        noteFailure(firstFailure, (*result)->getDescription());
+
+    if (_cancelRequested) {
+        // We can't roll back an operation that didn't agree to be
+        // canceled, but we can at least not run any more.
+
+        noteFailure(firstFailure, "Canceled after " + (*it)->getDescription());
+    }
+}
+
+
+void Worker::advanceOperationProgress () {
+    WORKER
+
+    int index = ++_progressOperationIndex;
+
+    if (_progressOperationCount > 1)
+        _progressPermyriad = (10000 * index) / _progressOperationCount;
+}
+
+
+void Worker::advanceDocumentGeneration () {
+    WORKER
+
+    _documentGeneration++;
+}
+
+
+auto Worker::prepareJournalChange (OperationBase const & operation)
+    -> JournalChange
+{
+    WORKER
+
+    JournalChange change;
+    change.staleUndo = 0;
+    change.staleRedo = 0;
+
+    change.entry.description = operation.getDescription();
+
+    optional<WriteSet> writeSet = operation.getWriteSet();
+
+    bool wholeDocument = not writeSet or std::any_of(
+        begin(*writeSet), end(*writeSet),
+        [](Node<methyl::Accessor> const & writeRoot) {
+            return not writeRoot->hasParent();
+        }
+    );
+
+    if (wholeDocument) {
+        // The operation could write anywhere, so any node the history
+        // refers to might not survive it.  What undoing it puts back is a
+        // copy of all of it, and the history goes over to that copy.
+
+        change.entry.document = (*_document)->makeCloneOfSubtree();
+
+        retargetJournals((*change.entry.document).root());
+
+        return change;
+    }
+
+    // Write roots nested inside other write roots are covered by the copy
+    // of the outer one.
+
+    std::vector<Node<methyl::Accessor>> roots;
+
+    for (auto & writeRoot : *writeSet) {
+
+        bool covered = std::any_of(
+            begin(*writeSet), end(*writeSet),
+            [&](Node<methyl::Accessor> const & other) {
+                return (other != writeRoot)
+                    and DaemonManager::isSameOrAncestorOf(other, writeRoot);
+            }
+        );
+
+        if (covered)
+            continue;
+
+        if (std::find(begin(roots), end(roots), writeRoot) != end(roots))
+            continue;
+
+        roots.push_back(writeRoot);
+    }
+
+    // An older entry whose nodes are strictly beneath what this operation
+    // writes may find them destroyed by it.  Undoing this one would then
+    // put back copies, not those nodes...so that history has to end here.
+    // (The same goes for redo entries, if a rollback swaps copies in.)
+
+    auto isBeneathRoots = [&](JournalEntry const & older) {
+        for (auto & swap : older.swaps) {
+            for (auto & root : roots) {
+                if (swap.first == root)
+                    continue;
+                if (DaemonManager::isSameOrAncestorOf(root, swap.first))
+                    return true;
+            }
+        }
+        return false;
+    };
+
+    auto countStale = [&](std::vector<JournalEntry> const & journal) {
+        auto newestBeneath = std::find_if(
+            journal.rbegin(), journal.rend(), isBeneathRoots
+        );
+        return static_cast<size_t>(newestBeneath.base() - begin(journal));
+    };
+
+    change.staleUndo = countStale(_undoJournal);
+    change.staleRedo = countStale(_redoJournal);
+
+    for (auto & root : roots)
+        change.entry.swaps.emplace_back(root, root->makeCloneOfSubtree());
+
+    return change;
+}
+
+
+void Worker::retargetJournals (Node<methyl::Accessor> copyRoot) {
+    WORKER
+
+    auto retarget = [&](std::vector<JournalEntry> & journal) {
+        for (auto it = journal.rbegin(); it != journal.rend(); it++) {
+            if (it->document)
+                break;
+
+            for (auto & swap : it->swaps)
+                swap.first = nodeAtPath(copyRoot, pathOfNode(swap.first));
+        }
+    };
+
+    retarget(_undoJournal);
+    retarget(_redoJournal);
+}
+
+
+void Worker::commitJournalChange (JournalChange && change) {
+    WORKER
+
+    // Whatever was undone is not coming back once something new happens.
+
+    _redoJournal.clear();
+
+    _undoJournal.erase(
+        begin(_undoJournal), begin(_undoJournal) + change.staleUndo
+    );
+
+    _undoJournal.push_back(std::move(change.entry));
+
+    if (_undoJournal.size() > maxUndoEntries) {
+        _undoJournal.erase(
+            begin(_undoJournal),
+            end(_undoJournal) - maxUndoEntries
         );
     }
+}
+
+
+void Worker::rollBackJournalChange (JournalChange & change) {
+    WORKER
+
+    // Entries in terms of nodes beneath the roots are about to lose them,
+    // as the roots are swapped out for copies.  Everything else is kept.
+
+    _undoJournal.erase(
+        begin(_undoJournal), begin(_undoJournal) + change.staleUndo
+    );
+    _redoJournal.erase(
+        begin(_redoJournal), begin(_redoJournal) + change.staleRedo
+    );
+
+    JournalEntry & entry = change.entry;
+
+    std::vector<Node<methyl::Accessor>> outgoing;
+    for (auto & swap : entry.swaps)
+        outgoing.push_back(swap.first);
+
+    swapJournalEntry(entry);
+
+    // That took care of the undo entries, but the redo entries also knew
+    // the roots by the nodes that just left.  (Unlike an undo, there's no
+    // redo of this to put those nodes back.)
+
+    for (size_t index = 0; index < outgoing.size(); index++) {
+        for (auto & newer : _redoJournal) {
+            for (auto & swap : newer.swaps) {
+                if (swap.first == outgoing[index])
+                    swap.first = entry.swaps[index].first;
+            }
+        }
+    }
+}
+
+
+void Worker::swapJournalEntry (JournalEntry & entry) {
+    WORKER
+
+    if (entry.document) {
+        // Entries that know nodes of the document going out are all on
+        // the other side of this one, which is where it is kept until it
+        // is swapped back in for them.
+
+        Tree<methyl::Accessor> outgoing = std::move(*_document);
+        _document = std::move(entry.document);
+        entry.document = std::move(outgoing);
+        return;
+    }
+
+    // Going backwards matters only if the roots share a parent, and then
+    // only for being the mirror image of how they were recorded.
+
+    for (auto it = entry.swaps.rbegin(); it != entry.swaps.rend(); it++) {
+        Node<methyl::Accessor> outgoing = it->first;
+        Node<methyl::Accessor> incoming = (it->second).root();
+
+        it->second = outgoing->replaceWith(std::move(it->second));
+        it->first = incoming;
+
+        // Older entries written to the same root knew it by the node that
+        // just left the document; the one now standing in its place is an
+        // exact copy of it from that time.
+
+        for (auto & older : _undoJournal) {
+            for (auto & swap : older.swaps) {
+                if (swap.first == outgoing)
+                    swap.first = incoming;
+            }
+        }
+    }
+}
+
+
+void Worker::applyJournalEntry (
+    std::vector<JournalEntry> & from,
+    std::vector<JournalEntry> & to,
+    QString const & verb
+) {
+    WORKER
+
+    if (from.empty())
+        return;
+
+    JournalEntry entry = std::move(from.back());
+    from.pop_back();
+
+    QString description = verb + " " + entry.description;
+
+    emit beginInvokeOperation(description, false);
+
+    auto & manager = _daemonManagerThread->getManager();
+
+    if (entry.document) {
+        manager.ensureAllDaemonsPaused(HERE);
+    } else {
+        WriteSet writeSet;
+        for (auto & swap : entry.swaps)
+            writeSet.push_back(swap.first);
+
+        manager.ensureAffectedDaemonsPaused(writeSet, HERE);
+    }
+
+    swapJournalEntry(entry);
+
+    // The paused daemons were observing nodes that are no longer in the
+    // document at all, which is nothing an observer can notice.
+
+    manager.ensurePausedDaemonsDiscarded(HERE);
+
+    to.push_back(std::move(entry));
+
+    advanceDocumentGeneration();
+
+    manager.ensureValidDaemonsResumed(HERE);
+
+    emit endInvokeOperation(true, description + " completed successfully.");
+
+    updateNoLaterThan(msecPerceivable);
+}
+
+
+void Worker::clearJournals () {
+    WORKER
+
+    _undoJournal.clear();
+    _redoJournal.clear();
+}
+
+
+void Worker::onUndoRequest () {
+    WORKER
+
+    applyJournalEntry(_undoJournal, _redoJournal, "Undo");
+}
+
+
+void Worker::onRedoRequest () {
+    WORKER
+
+    applyJournalEntry(_redoJournal, _undoJournal, "Redo");
+}
+
+
+void Worker::queueInvokeOperationMaybe (
+    unique_ptr<OperationBase> && operation
+) {
+    bool wasEmpty;
+
+    {
+        QMutexLocker lock (&_queuedOperationsMutex);
+        wasEmpty = _queuedOperations.empty();
+        _queuedOperations.push_back(std::move(operation));
+    }
+
+    if (wasEmpty)
+        emit queuedOperationsPending();
+}
+
+
+void Worker::onQueuedOperationsPending () {
+    WORKER
+
+    std::vector<unique_ptr<OperationBase>> operations;
+
+    {
+        QMutexLocker lock (&_queuedOperationsMutex);
+        operations.swap(_queuedOperations);
+    }
+
+    if (operations.empty())
+        return;
+
+    invokeOperations(std::move(operations));
+}
+
+
+void Worker::onSpeculationPending () {
+    WORKER
+
+    // The user may have moved on (or pressed) while this was queued.
+
+    if (_status != OperationStatus::Hovering)
+        return;
+
+    speculateOperation();
 
     updateNoLaterThan(msecPerceivable);
 }
 
 
+void Worker::speculateOperation () {
+    WORKER
+
+    _status.hopefullyEqualTo(OperationStatus::Hovering, HERE);
+
+    if (not _operation or not (*_operation)->isSpeculatable())
+        return;
+
+    if (
+        _speculativeDocument
+        and (_speculativeHit == _hitListTree[0])
+        and (_speculativeGeneration == _documentGeneration)
+    ) {
+        // The hover timer restarts on every mouse move, even within the
+        // same hit.  We already have the answer for this one, unless the
+        // document has changed since.
+        return;
+    }
+
+    discardSpeculation();
+
+    // A two-phase operation does its analysis in prepare(), and invoke()
+    // only applies what was stored there, so the speculative run has to go
+    // through both phases just as a real one would.  prepare() reads the
+    // real document while the daemons are running, which is no different
+    // from what it does ahead of a real invoke().  If it fails there is
+    // nothing to preview; the real invocation will report why.
+
+    if ((*_operation)->isTwoPhase()) {
+        if ((*_operation)->prepare())
+            return;
+    }
+
+    // The daemons are not paused.  Nothing they observe is written, since
+    // a speculatable operation promises to write only through getDocument()
+    // (see isSpeculatable), and that hands out the fork for the duration.
+    // The real document is left exactly as it was, and so are the history
+    // and the hits the operation was made from.
+
+    _speculativeDocument = (*_document)->makeCloneOfSubtree();
+    _speculativeHit = _hitListTree[0];
+    _speculativeGeneration = _documentGeneration;
+
+    _isSpeculating = true;
+    optional<Tree<methyl::Error>> result = (*_operation)->invoke();
+    _isSpeculating = false;
+
+    if (result) {
+        // No preview for an operation that fails; the real invocation will
+        // report the error if the user goes through with it.
+        discardSpeculation();
+    }
+}
+
+
+void Worker::discardSpeculation () {
+    WORKER
+
+    hopefully(not _isSpeculating, HERE);
+
+    _speculativeDocument = nullopt;
+    _speculativeHit = nullopt;
+}
+
+
+bool Worker::tryCommitSpeculation () {
+    WORKER
+
+    if (not _speculativeDocument)
+        return false;
+
+    // Only the exact gesture we speculated on may use the result.  A press
+    // and release on the hovered hit yields the same single-hit list that
+    // the hover did, but a drag will have grown the list.
+
+    if ((_hitListTree.size() != 1) or (_hitListTree[0] != _speculativeHit))
+        return false;
+
+    // Queued operations may have run since the fork was made, in which
+    // case it is a fork of a document that no longer exists.
+
+    if (_speculativeGeneration != _documentGeneration)
+        return false;
+
+    emit beginInvokeOperation((*_operation)->getDescription(), false);
+
+    auto & manager = _daemonManagerThread->getManager();
+
+    manager.ensureAllDaemonsPaused(HERE);
+
+    // Every daemon was observing nodes of the document we are about to
+    // take out, so none of them can be revalidated.
+
+    manager.ensurePausedDaemonsDiscarded(HERE);
+
+    // The old document is kept whole in the history, so undoing puts the
+    // very nodes back that the older entries refer to.
+
+    JournalChange change;
+    change.staleUndo = 0;
+    change.staleRedo = 0;
+    change.entry.description = (*_operation)->getDescription();
+    change.entry.document = std::move(_speculativeDocument);
+    _speculativeDocument = nullopt;
+
+    swapJournalEntry(change.entry);
+
+    commitJournalChange(std::move(change));
+
+    advanceDocumentGeneration();
+
+    manager.ensureValidDaemonsResumed(HERE);
+
+    emit endInvokeOperation(
+        true,
+        (*_operation)->getDescription() + " completed successfully."
+    );
+
+    return true;
+}
+
+
 void Worker::syncOperation () {
     WORKER
 
@@ -546,6 +1302,10 @@ Worker::~Worker () {
     _daemonManagerThread->shutdown();
     _daemonManagerThread.reset();
 
+    discardSpeculation();
+
+    clearJournals();
+
     _document = nullopt;
 
     delete methyl::globalEngine;
@@ -23,6 +23,7 @@
 #define BENZENE_WORKER_H
 
 #include <unordered_set>
+#include <atomic>
 
 #include <QThread>
 #include <QWaitCondition>
@@ -160,6 +161,154 @@ private:
 
     shared_ptr<methyl::Context> _dummyContext;
 
+    // Every time the document is changed, it becomes a new version with a
+    // higher generation number.  Methyl only has one copy of the document,
+    // so old versions can't be read once they are gone...but a number is
+    // enough to ask "was this computed against the document as it is now?"
+    // without consulting any observers.  Readable from any thread.
+    //
+    // This is numbering only, not versioned reads.  Daemons still have to
+    // be paused for every edit that could free what they are looking at.
+
+    std::atomic<quint64> _documentGeneration;
+
+    void advanceDocumentGeneration ();
+
+    // When a hovered operation is speculatable, it is invoked against a
+    // deep copy of the document.  (Methyl has no copy-on-write trees, so
+    // the "fork" is a full clone; only operations which opt in pay for it.)
+    // The hit it was made for is remembered so that a release on that
+    // same hit can commit the fork instead of invoking all over again, and
+    // the generation so a fork of an older document is never committed.
+    //
+    // It runs on the worker, as invoke() has to be the only thing writing
+    // (see invokeOperationAlone), but the daemons keep going: the fork is
+    // not something they observe.  It is queued rather than done right
+    // when the hover timer fires, so the hover can be drawn meanwhile.
+
+    optional<methyl::Tree<methyl::Accessor>> _speculativeDocument;
+
+    optional<methyl::Tree<Hit>> _speculativeHit;
+
+    quint64 _speculativeGeneration;
+
+    bool _isSpeculating;
+
+
+private:
+    // Set from the GUI thread when the user presses Cancel in the RunDialog,
+    // and reported to operations through wasPauseRequested().  Cleared
+    // before and after each batch.
+
+    std::atomic<bool> _cancelRequested;
+
+    // An operation that isn't cancellable would just stop partway through
+    // if told about the cancel, leaving a partial edit that nothing rolls
+    // back.  So the flag is only passed along while what is running on
+    // the worker can cope with it: a prepare(), which writes nothing, or
+    // the invoke() of a cancellable operation.
+
+    bool _isCancelObservable;
+
+public:
+    void requestCancel () {
+        _cancelRequested = true;
+    }
+
+
+private:
+    // Undo is done by keeping copies of the subtrees that an operation
+    // declared in its WriteSet, taken just before it ran.  Undoing swaps
+    // the copies back into the document, and what comes out becomes the
+    // copies for a redo.  Methyl has no notification of individual writes,
+    // so this is the finest grain available.  An operation without a
+    // WriteSet (or one that writes the document root) has the whole
+    // document copied instead, and undoing it replaces the Tree we hold.
+
+    struct JournalEntry {
+        QString description;
+
+        std::vector<std::pair<
+            methyl::Node<methyl::Accessor>,
+            methyl::Tree<methyl::Accessor>
+        >> swaps;
+
+        optional<methyl::Tree<methyl::Accessor>> document;
+    };
+
+    std::vector<JournalEntry> _undoJournal;
+
+    std::vector<JournalEntry> _redoJournal;
+
+    // What invoking an operation does to the history is worked out before
+    // it runs, since afterward the nodes that's in terms of may be gone.
+    // But it's only applied once the operation has gone through, so one
+    // that is cancelled and rolled back leaves the history as it was.  The
+    // stale counts are of the oldest entries it invalidates.
+
+    struct JournalChange {
+        JournalEntry entry;
+
+        size_t staleUndo;
+
+        size_t staleRedo;
+    };
+
+    JournalChange prepareJournalChange (OperationBase const & operation);
+
+    // The entries that know their roots by nodes of the live document are
+    // the ones newer than any whole-document entry.  Before the document
+    // is copied for such an entry, those are moved over to the same places
+    // in the copy, which is what undoing it will put back.
+
+    void retargetJournals (methyl::Node<methyl::Accessor> copyRoot);
+
+    void commitJournalChange (JournalChange && change);
+
+    // Swaps the entry's copies back in.  The change has to be kept around
+    // until the paused daemons are discarded, as it holds what they saw.
+
+    void rollBackJournalChange (JournalChange & change);
+
+    // Methyl trees can't say how much memory they hold, so the history is
+    // bounded by a count of entries; the oldest are forgotten first.
+
+    static size_t const maxUndoEntries = 100;
+
+    void swapJournalEntry (JournalEntry & entry);
+
+    void applyJournalEntry (
+        std::vector<JournalEntry> & from,
+        std::vector<JournalEntry> & to,
+        QString const & verb
+    );
+
+    void clearJournals ();
+
+public slots:
+    void onUndoRequest ();
+
+    void onRedoRequest ();
+
+
+friend class ApplicationBase;
+friend void reportProgress (float fraction, QString const & phase);
+private:
+    // Progress of the running batch, in ten-thousandths so it fits in an
+    // atomic int.  -1 means nobody has reported anything (show as busy).
+    // The index and count let each operation report its own 0.0 to 1.0
+    // while the total still moves forward across a batch.
+
+    std::atomic<int> _progressPermyriad;
+
+    QMutex _progressPhaseMutex;
+
+    QString _progressPhase;
+
+    int _progressOperationIndex;
+
+    int _progressOperationCount;
+
 
 friend class DaemonBase;
 friend bool ::benzene::isDaemonManagerThreadCurrent();
@@ -279,13 +428,25 @@ public slots:
 private:
     void syncOperation();
 
+    void speculateOperation ();
+
+    void discardSpeculation ();
+
+    bool tryCommitSpeculation ();
+
+signals:
+    void speculationPending ();
+
+private slots:
+    void onSpeculationPending ();
+
 
 // Operations are always invoked on the worker, so that the GUI thread can
 // offer a progress dialog if a certain amount of time is taken.  This is
 // the only time that a client object can have write access on user documents.
 
 signals:
-    void beginInvokeOperation (QString message);
+    void beginInvokeOperation (QString message, bool cancellable);
 
     void endInvokeOperation (bool success, QString message);
 
@@ -301,22 +462,66 @@ public:
 
     void invokeOperation (unique_ptr<OperationBase> operation);
 
-signals:
+private:
+    // Every invocation costs a pause of all the daemons and a resume with
+    // a validity check of each one, and those are blocking round trips to
+    // the DaemonManager thread.  So when operations arrive in bulk they
+    // are all run inside one pause window.
+
+    void invokeOperations (
+        std::vector<unique_ptr<OperationBase>> && operations
+    );
+
+    typedef std::vector<unique_ptr<OperationBase>>::iterator OperationIterator;
+
+    // One pause of the daemons, covering operations [first, last).  If the
+    // first is a two-phase operation it is prepared before the pause.
+
+    void invokeOperationWindow (
+        OperationIterator first,
+        OperationIterator last,
+        optional<QString> & firstFailure
+    );
+
+    // Operations in a window are invoked one at a time, in the order they
+    // were requested, even when their WriteSets don't overlap.  Running
+    // those at once would need Methyl to allow concurrent writers (and
+    // separate creation contexts), which nothing yet says it does.
+
+    void invokeOperationAlone (
+        OperationIterator it,
+        optional<QString> & firstFailure
+    );
+
+    void advanceOperationProgress ();
+
+
+public:
     // Here we have a conundrum.  What do we do if an operation is
     // queued and we have already applied another operation which
     // might invalidate the expectations of the other operation?
     //
     // There's no easy solution I can think of besides possibly just
     // throwing this operation out.  For now we'll just risk it.
+    //
+    // May be called from any thread.  Operations queued before the worker
+    // gets around to them are invoked together as one batch.
 
-    void queueInvokeOperationMaybe (OperationBase * opOwned);
+    void queueInvokeOperationMaybe (unique_ptr<OperationBase> && operation);
 
-private slots:
-    void onQueueInvokeOperationMaybe (OperationBase * opOwned) {
-        WORKER
+private:
+    QMutex _queuedOperationsMutex;
 
-        invokeOperation(unique_ptr<OperationBase>(opOwned));
-    }
+    std::vector<unique_ptr<OperationBase>> _queuedOperations;
+
+signals:
+    // Only emitted when the queue goes from empty to non-empty, so there
+    // is at most one of these sitting in the worker's event queue.
+
+    void queuedOperationsPending ();
+
+private slots:
+    void onQueuedOperationsPending ();
 
 
 private: